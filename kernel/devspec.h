@@ -812,3 +812,88 @@
 			0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 		}
 	},
+
+/*
+ * Generic
+ */
+
+	{
+		.id = {
+			.bustype = 0,
+			.vendor = 0,
+			.product = 0,
+			.version = 0
+		},
+		.cname = "generic-720p_touchscreen",
+		.name = "720p touchscreen",
+		.evbit = {
+			[EV_ABS/BITS_PER_BYTE] = 1<<(EV_ABS%BITS_PER_BYTE)
+		},
+		.absbit = {
+			[6] = (1<<((ABS_MT_TOUCH_MAJOR)%BITS_PER_BYTE)) |
+			      (1<<((ABS_MT_WIDTH_MAJOR)%BITS_PER_BYTE)) |
+			      (1<<((ABS_MT_ORIENTATION)%BITS_PER_BYTE)) |
+			      (1<<((ABS_MT_POSITION_X)%BITS_PER_BYTE)) |
+			      (1<<((ABS_MT_POSITION_Y)%BITS_PER_BYTE)),
+			[7] = (1<<((ABS_MT_TRACKING_ID)%BITS_PER_BYTE)) |
+			      (1<<((ABS_MT_PRESSURE)%BITS_PER_BYTE))
+		},
+		.absinfo = {
+			[ABS_MT_TOUCH_MAJOR] = {
+				.value = 0,
+				.minimum = 0,
+				.maximum = 255,
+				.fuzz = 0,
+				.flat = 0,
+				.resolution = 0
+			},
+			[ABS_MT_WIDTH_MAJOR] = {
+				.value = 0,
+				.minimum = 0,
+				.maximum = 15,
+				.fuzz = 0,
+				.flat = 0,
+				.resolution = 0
+			},
+			[ABS_MT_ORIENTATION] = {
+				.value = 0,
+				.minimum = 0,
+				.maximum = 0,
+				.fuzz = 0,
+				.flat = 0,
+				.resolution = 0
+			},
+			[ABS_MT_POSITION_X] = {
+				.value = 0,
+				.minimum = 0,
+				.maximum = 719,
+				.fuzz = 0,
+				.flat = 0,
+				.resolution = 0
+			},
+			[ABS_MT_POSITION_Y] = {
+				.value = 0,
+				.minimum = 0,
+				.maximum = 1279,
+				.fuzz = 0,
+				.flat = 0,
+				.resolution = 0
+			},
+			[ABS_MT_TRACKING_ID] = {
+				.value = 0,
+				.minimum = 0,
+				.maximum = 10,
+				.fuzz = 0,
+				.flat = 0,
+				.resolution = 0
+			},
+			[ABS_MT_PRESSURE] = {
+				.value = 0,
+				.minimum = 0,
+				.maximum = 255,
+				.fuzz = 0,
+				.flat = 0,
+				.resolution = 0
+			}
+		}
+	},
@@ -16,27 +16,104 @@
 ** limitations under the License.
 */
 
+// for struct ucred
+#define _GNU_SOURCE
+
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <dirent.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
 
 #ifdef NDK_BUILD
 #include "linux_input.h"
 #else
 #include <linux/input.h>
+#include <linux/uinput.h>
 #endif
 
+#include "kernel/devinfo.h"
+
+#ifdef ANDROID
 #include <sys/system_properties.h>
+#endif
+
+#define MAX_SPLINE_POINTS 16
+#define MAX_COMMAND_ARGS (2 * MAX_SPLINE_POINTS + 2)
+
+#define NSEC_PER_USEC 1000LL
+#define NSEC_PER_MSEC 1000000LL
+#define NSEC_PER_SEC  1000000000LL
+
+#ifndef PR_SET_TIMERSLACK
+#define PR_SET_TIMERSLACK 29
+#define PR_GET_TIMERSLACK 30
+#endif
+
+#ifndef EVIOCSCLOCKID
+#define EVIOCSCLOCKID _IOW('E', 0xa0, int)
+#endif
+
+// uinput, which the NDK's headers don't have; other builds get it from
+// <linux/uinput.h>
+#ifndef UINPUT_IOCTL_BASE
+#define UINPUT_IOCTL_BASE 'U'
+#define UINPUT_MAX_NAME_SIZE 80
+#define UI_DEV_CREATE _IO(UINPUT_IOCTL_BASE, 1)
+#define UI_DEV_DESTROY _IO(UINPUT_IOCTL_BASE, 2)
+#define UI_SET_EVBIT _IOW(UINPUT_IOCTL_BASE, 100, int)
+#define UI_SET_KEYBIT _IOW(UINPUT_IOCTL_BASE, 101, int)
+#define UI_SET_RELBIT _IOW(UINPUT_IOCTL_BASE, 102, int)
+#define UI_SET_ABSBIT _IOW(UINPUT_IOCTL_BASE, 103, int)
+#define UI_SET_MSCBIT _IOW(UINPUT_IOCTL_BASE, 104, int)
+#define UI_SET_LEDBIT _IOW(UINPUT_IOCTL_BASE, 105, int)
+#define UI_SET_SNDBIT _IOW(UINPUT_IOCTL_BASE, 106, int)
+#define UI_SET_FFBIT _IOW(UINPUT_IOCTL_BASE, 107, int)
+#define UI_SET_SWBIT _IOW(UINPUT_IOCTL_BASE, 109, int)
+#define UI_SET_PROPBIT _IOW(UINPUT_IOCTL_BASE, 110, int)
+#define UI_GET_SYSNAME(len) _IOC(_IOC_READ, UINPUT_IOCTL_BASE, 44, len)
+
+struct uinput_user_dev {
+  char name[UINPUT_MAX_NAME_SIZE];
+  struct input_id id;
+  uint32_t ff_effects_max;
+  int32_t absmax[ABS_MAX + 1];
+  int32_t absmin[ABS_MAX + 1];
+  int32_t absfuzz[ABS_MAX + 1];
+  int32_t absflat[ABS_MAX + 1];
+};
+#endif
+
+// older <linux/uinput.h> may not have these yet
+#ifndef UI_SET_PROPBIT
+#define UI_SET_PROPBIT _IOW(UINPUT_IOCTL_BASE, 110, int)
+#endif
 
-#define MAX_COMMAND_ARGS 16
-#define MAX_COMMAND_LEN 256
+#ifndef UI_GET_SYSNAME
+#define UI_GET_SYSNAME(len) _IOC(_IOC_READ, UINPUT_IOCTL_BASE, 44, len)
+#endif
 
 #define test_bit(bit, array)    (array[bit/8] & (1<<(bit%8)))
 
@@ -53,335 +130,1996 @@ enum {
 
 static int global_tracking_id = 1;
 
+/* How orng keeps time. */
+enum {
+  CLOCK_MODE_REAL = 0, /* CLOCK_MONOTONIC, sleeping until every deadline */
+  CLOCK_MODE_NONE,     /* CLOCK_MONOTONIC, but never sleep, so that a run
+                          only measures what orng itself costs */
+  CLOCK_MODE_VIRTUAL   /* when compiling scripts nothing is sent anywhere,
+                          so sleeping only moves a virtual clock forward */
+};
+
+static int clock_mode = CLOCK_MODE_REAL;
+static int64_t virtual_now_nsec = 0;
+
+/* Current CLOCK_MONOTONIC time in nanoseconds. */
+int64_t now_nsec(void)
+{
+  struct timespec ts;
+
+  if (clock_mode == CLOCK_MODE_VIRTUAL)
+    return virtual_now_nsec;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* write() and clock_nanosleep() calls made so far, for the timing report */
+static unsigned long num_syscalls = 0;
+
+/* Sleep until the absolute CLOCK_MONOTONIC time deadline_nsec. Gestures plan
+   every frame against a fixed start time, so oversleeping one frame doesn't
+   push back all the frames after it. */
+void sleep_until(int64_t deadline_nsec)
+{
+  struct timespec ts;
+  int ret;
+
+  if (clock_mode == CLOCK_MODE_VIRTUAL) {
+    if (deadline_nsec > virtual_now_nsec)
+      virtual_now_nsec = deadline_nsec;
+    return;
+  } else if (clock_mode == CLOCK_MODE_NONE) {
+    return;
+  }
+
+  ts.tv_sec = deadline_nsec / NSEC_PER_SEC;
+  ts.tv_nsec = deadline_nsec % NSEC_PER_SEC;
+
+  do {
+    num_syscalls++;
+#ifdef NDK_BUILD
+    // older bionic doesn't wrap clock_nanosleep(), use the syscall directly
+    ret = syscall(__NR_clock_nanosleep, CLOCK_MONOTONIC, TIMER_ABSTIME,
+                  &ts, NULL) < 0 ? errno : 0;
+#else
+    ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+#endif
+  } while (ret == EINTR);
+}
+
+int compare_int64(const void *lhs, const void *rhs)
+{
+  int64_t a = *(const int64_t *)lhs, b = *(const int64_t *)rhs;
+  return (a > b) - (a < b);
+}
+
 enum {
   ACTION_START = 0,
-  ACTION_END = 1
+  ACTION_END = 1,
+  ACTION_MARK = 2 /* a point in time, doesn't open or close a level */
+};
+
+/* Tracing (-t) must not disturb the timing it measures, so the executors
+   only fill in fixed-size binary records in a preallocated ring. A writer
+   thread formats them in the background, as JSON lines or in the Chrome
+   trace-event format, and whatever is left is formatted when orng exits. The
+   ring has a single producer and a single consumer, and each side only ever
+   moves its own index. */
+#define MAX_TRACE_ARGS 10
+#define TRACE_RING_SIZE 65536 /* records, must be a power of two */
+#define TRACE_WRITER_INTERVAL_MSEC 50
+
+enum {
+  TRACE_SLEEP = 0,
+  TRACE_PRESS,
+  TRACE_MOVE,
+  TRACE_RELEASE,
+  TRACE_DRAG,
+  TRACE_TAP,
+  TRACE_PINCH,
+  TRACE_CURVE,
+  TRACE_ROTATE,
+  TRACE_SWIPE,
+  TRACE_STRESS,
+  TRACE_PARALLEL,
+  TRACE_RESET,
+  TRACE_REPLAY,
+  TRACE_LATE_WAKEUP,
+  TRACE_FRAME,
+  NUM_TRACE_ACTIONS
+};
+
+struct trace_action {
+  const char *name;
+  int num_args;
+  const char *args[MAX_TRACE_ARGS];
+  unsigned usec_args; /* bitmask of args kept in usec and printed in msec */
+};
+
+static const struct trace_action trace_actions[NUM_TRACE_ACTIONS] = {
+  { "sleep", 1, { "duration" }, 1 },
+  { "press", 2, { "x", "y" }, 0 },
+  { "move", 2, { "x", "y" }, 0 },
+  { "release", 0, { NULL }, 0 },
+  { "drag", 8, { "start_x", "start_y", "end_x", "end_y", "num_steps",
+                 "duration_msec", "profile", "profile_arg" }, 0 },
+  { "tap", 4, { "x", "y", "num_times", "duration_msec" }, 0 },
+  { "pinch", 10, { "touch1_x1", "touch1_y1", "touch1_x2", "touch1_y2",
+                   "touch2_x1", "touch2_y1", "touch2_x2", "touch2_y2",
+                   "num_steps", "duration_msec" }, 0 },
+  { "curve", 7, { "start_x", "start_y", "end_x", "end_y", "num_points",
+                  "num_steps", "duration_msec" }, 0 },
+  { "rotate", 7, { "center_x", "center_y", "radius", "degrees",
+                   "num_fingers", "num_steps", "duration_msec" }, 0 },
+  { "swipe", 8, { "start_x", "start_y", "end_x", "end_y", "num_fingers",
+                  "spacing", "num_steps", "duration_msec" }, 0 },
+  { "stress", 6, { "center_x", "center_y", "radius", "num_fingers",
+                   "num_steps", "duration_msec" }, 0 },
+  { "parallel", 1, { "lanes" }, 0 },
+  { "reset", 0, { NULL }, 0 },
+  { "replay", 1, { "frames" }, 0 },
+  { "late_wakeup", 1, { "late_usec" }, 0 },
+  { "frame", 2, { "events", "late" }, 2 }
+};
+
+struct trace_record {
+  int64_t nsec;
+  uint16_t action;
+  uint8_t start_end;
+  uint8_t level;
+  int32_t args[MAX_TRACE_ARGS];
+};
+
+enum {
+  TRACE_FORMAT_JSON = 0, /* one JSON object per line, on stdout */
+  TRACE_FORMAT_CHROME    /* Chrome trace-event format, for Perfetto */
 };
 
 static int print_actions = 0;
 static int action_level = 0;
+static int trace_format = TRACE_FORMAT_JSON;
+static FILE *trace_out = NULL;
+static int trace_pid = 0;
 
-void print_action(int start_end, const char *action_desc,
-                  const char *args_fmt, ...)
+/* previous frame, for the frame interval counters in Chrome traces */
+static int64_t trace_last_planned_nsec = -1;
+static int64_t trace_last_actual_nsec = -1;
+
+static struct trace_record *trace_ring = NULL;
+static volatile uint32_t trace_head = 0; /* written by the executors */
+static volatile uint32_t trace_tail = 0; /* written by the writer */
+static uint32_t trace_dropped = 0;
+static volatile int trace_writer_stop = 0;
+static volatile sig_atomic_t trace_signal = 0;
+static pthread_t trace_writer;
+
+void print_action(int start_end, int action, ...)
 {
-  const char *start_end_str;
-  struct timeval tv;
-  int current_arg = 0;
-  int i, n;
-  int arg;
+  struct trace_record *record;
+  uint32_t head = trace_head;
   va_list ap;
-  char *args_str = NULL, args_str2;
-  int args_str_size = 128;
+  int i;
 
   if (!print_actions)
     return;
 
-  gettimeofday(&tv, NULL);
-
-  if (start_end == ACTION_START)
-    start_end_str = "START";
-  else {
-    start_end_str = "END";
+  if (start_end == ACTION_END)
     action_level--;
-  }
-
-  if (args_fmt) {
-    args_str = (char *)malloc(args_str_size);
-    assert(args_str);
-
-    va_start(ap, args_fmt);
-    n = vsnprintf(args_str, args_str_size, args_fmt, ap);
-    va_end(ap);
-    if (n == -1 || n >= args_str_size) {
-      args_str_size = n + 1;
 
-      args_str = (char *)realloc(args_str, args_str_size);
+  __sync_synchronize();
+  if (head - trace_tail == TRACE_RING_SIZE) {
+    trace_dropped++;
+  } else {
+    record = &trace_ring[head & (TRACE_RING_SIZE - 1)];
+    record->nsec = now_nsec();
+    record->action = action;
+    record->start_end = start_end;
+    record->level = action_level;
 
-      va_start(ap, args_fmt);
-      vsnprintf(args_str, args_str_size, args_fmt, ap);
+    if (start_end != ACTION_END) {
+      va_start(ap, action);
+      for (i=0; i<trace_actions[action].num_args; i++)
+        record->args[i] = va_arg(ap, int);
       va_end(ap);
     }
-    printf("{ \"event\": \"%s\", \"type\": \"%s\", \"level\": %d, "
-           "\"time\": %ld.%06ld, \"params\": { %s } }\n", start_end_str,
-           action_desc, action_level, tv.tv_sec, tv.tv_usec, args_str);
-  } else {
-    printf("{ \"event\": \"%s\", \"type\": \"%s\", \"level\": %d, "
-           "\"time\": %ld.%06ld }\n", start_end_str, action_desc, action_level,
-           tv.tv_sec, tv.tv_usec);
+
+    // publish the record only once it's complete
+    __sync_synchronize();
+    trace_head = head + 1;
   }
 
   if (start_end == ACTION_START)
     action_level++;
-
-  free(args_str);
 }
 
-void write_event(int fd, int type, int code, int value)
+/* Record that a frame planned for planned_nsec has just been written. */
+void trace_frame(int num_events, int64_t planned_nsec)
 {
-  struct input_event event;
-  memset(&event, 0, sizeof(event));
-
-  event.type = type;
-  event.code = code;
+  int64_t late_usec;
 
-  event.value = value;
-  usleep(1000);
+  if (!print_actions)
+    return;
 
-  ssize_t ret = 0;
-  unsigned char *buf = (unsigned char*)&event;
-  ssize_t buflen = (ssize_t)sizeof(event);
+  late_usec = (now_nsec() - planned_nsec) / NSEC_PER_USEC;
+  if (late_usec > INT32_MAX)
+    late_usec = INT32_MAX;
+  else if (late_usec < INT32_MIN)
+    late_usec = INT32_MIN;
+  print_action(ACTION_MARK, TRACE_FRAME, num_events, (int)late_usec);
+}
 
-  do {
-    ret = write(fd, buf, buflen);
-    if (ret > 0) {
-      buf += ret;
-      buflen -= ret;
-    }
-  } while (((ret >= 0) && buflen) || ((ret < 0) && (errno == EINTR)));
+void format_trace_args(const struct trace_record *record, FILE *f)
+{
+  const struct trace_action *action = &trace_actions[record->action];
+  int i;
 
-  if (ret < 0) {
-    fprintf(stderr, "write event failed, %s\n", strerror(errno));
-    return;
+  fprintf(f, "{ ");
+  for (i=0; i<action->num_args; i++) {
+    if (action->usec_args & (1u << i))
+      fprintf(f, "%s\"%s\": %.3f", i ? ", " : "", action->args[i],
+              record->args[i] / 1000.0);
+    else
+      fprintf(f, "%s\"%s\": %d", i ? ", " : "", action->args[i],
+              record->args[i]);
   }
+  fprintf(f, " }");
 }
 
-void execute_sleep(int duration_msec)
+void format_trace_record(const struct trace_record *record, FILE *f)
 {
-  print_action(ACTION_START, "sleep", "\"duration\": %d", duration_msec);
-  usleep(duration_msec*1000);
-  print_action(ACTION_END, "sleep", NULL);
+  static const char *start_end_str[] = { "START", "END", "MARK" };
+  const struct trace_action *action = &trace_actions[record->action];
+
+  fprintf(f, "{ \"event\": \"%s\", \"type\": \"%s\", \"level\": %d, "
+          "\"time\": %lld.%09lld", start_end_str[record->start_end],
+          action->name, record->level,
+          (long long)(record->nsec / NSEC_PER_SEC),
+          (long long)(record->nsec % NSEC_PER_SEC));
+
+  if (record->start_end != ACTION_END && action->num_args) {
+    fprintf(f, ", \"params\": ");
+    format_trace_args(record, f);
+  }
+  fprintf(f, " }\n");
 }
 
-void change_mt_slot(int fd, uint32_t device_flags, int slot)
+/* Chrome trace events have microsecond timestamps; CLOCK_MONOTONIC is what
+   the kernel's trace clock reads too, so orng's slices line up with a
+   systrace of the device. */
+void format_chrome_timestamp(int64_t nsec, FILE *f)
 {
-  write_event(fd, EV_ABS, ABS_MT_SLOT, slot);
+  fprintf(f, "\"ts\": %lld.%03lld, \"pid\": %d, \"tid\": %d",
+          (long long)(nsec / NSEC_PER_USEC), (long long)(nsec % NSEC_PER_USEC),
+          trace_pid, trace_pid);
 }
 
-void execute_press(int fd, uint32_t device_flags, int x, int y)
+/* Gestures and their steps become nested duration slices, late wakeups
+   become instant events, and frames feed counter tracks comparing the
+   planned and actual interval between frames, and how late each was. */
+void format_chrome_record(const struct trace_record *record, FILE *f)
 {
-  print_action(ACTION_START, "press", "\"x\": %d, \"y\": %d", x, y);
-  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
-    write_event(fd, EV_ABS, ABS_MT_TRACKING_ID, global_tracking_id++);
-    write_event(fd, EV_ABS, ABS_MT_POSITION_X, x);
-    write_event(fd, EV_ABS, ABS_MT_POSITION_Y, y);
-    write_event(fd, EV_ABS, ABS_MT_PRESSURE, 127);
-    write_event(fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 127);
-    write_event(fd, EV_ABS, ABS_MT_WIDTH_MAJOR, 4);
-    if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)
-      write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
-    write_event(fd, EV_KEY, BTN_TOUCH, 1);
-    write_event(fd, EV_SYN, SYN_REPORT, 0);
-  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
-    write_event(fd, EV_ABS, ABS_X, x);
-    write_event(fd, EV_ABS, ABS_Y, y);
-    write_event(fd, EV_KEY, BTN_TOUCH, 1);
-    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  static const char *phase[] = { "B", "E", "i" };
+  const struct trace_action *action = &trace_actions[record->action];
+  int64_t planned_nsec = 0;
+
+  if (record->action == TRACE_FRAME) {
+    planned_nsec = record->nsec - (int64_t)record->args[1] * NSEC_PER_USEC;
+    if (trace_last_actual_nsec >= 0) {
+      fprintf(f, ",\n{ \"name\": \"frame interval (ms)\", \"ph\": \"C\", ");
+      format_chrome_timestamp(record->nsec, f);
+      fprintf(f, ", \"args\": { \"planned\": %.3f, \"actual\": %.3f } }",
+              (planned_nsec - trace_last_planned_nsec) / 1e6,
+              (record->nsec - trace_last_actual_nsec) / 1e6);
+    }
+    fprintf(f, ",\n{ \"name\": \"frame lateness (ms)\", \"ph\": \"C\", ");
+    format_chrome_timestamp(record->nsec, f);
+    fprintf(f, ", \"args\": { \"late\": %.3f } }", record->args[1] / 1000.0);
+
+    trace_last_planned_nsec = planned_nsec;
+    trace_last_actual_nsec = record->nsec;
+    return;
+  }
+
+  fprintf(f, ",\n{ \"name\": \"%s\", \"cat\": \"orng\", \"ph\": \"%s\", ",
+          action->name, phase[record->start_end]);
+  format_chrome_timestamp(record->nsec, f);
+  if (record->start_end == ACTION_MARK)
+    fprintf(f, ", \"s\": \"t\"");
+  if (record->start_end != ACTION_END && action->num_args) {
+    fprintf(f, ", \"args\": ");
+    format_trace_args(record, f);
   }
-  print_action(ACTION_END, "press", NULL);
+  fprintf(f, " }");
 }
 
-void execute_move(int fd, uint32_t device_flags, int x, int y)
+/* Format everything in the ring. Batches are written out under the stdio
+   lock, so they don't get mixed up with other output. */
+void drain_trace(void)
 {
-  print_action(ACTION_START, "move", "\"x\": %d, \"y\": %d", x, y);
-  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
-    write_event(fd, EV_ABS, ABS_MT_POSITION_X, x);
-    write_event(fd, EV_ABS, ABS_MT_POSITION_Y, y);
-    write_event(fd, EV_ABS, ABS_MT_PRESSURE, 127);
-    write_event(fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 127);
-    write_event(fd, EV_ABS, ABS_MT_WIDTH_MAJOR, 4);
-    if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)
-      write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
-    write_event(fd, EV_SYN, SYN_REPORT, 0);
-  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
-    write_event(fd, EV_ABS, ABS_X, x);
-    write_event(fd, EV_ABS, ABS_Y, y);
-    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  uint32_t tail = trace_tail;
+  uint32_t head;
+
+  __sync_synchronize();
+  head = trace_head;
+  if (head == tail)
+    return;
+
+  flockfile(trace_out);
+  for (; tail != head; tail++) {
+    if (trace_format == TRACE_FORMAT_CHROME)
+      format_chrome_record(&trace_ring[tail & (TRACE_RING_SIZE - 1)],
+                           trace_out);
+    else
+      format_trace_record(&trace_ring[tail & (TRACE_RING_SIZE - 1)],
+                          trace_out);
   }
-  print_action(ACTION_END, "move", NULL);
+  fflush(trace_out);
+  funlockfile(trace_out);
+
+  __sync_synchronize();
+  trace_tail = tail;
 }
 
-void execute_release(int fd, uint32_t device_flags)
+/* Format what's left and close the trace. */
+void finish_trace(void)
 {
-  print_action(ACTION_START, "release", NULL);
-  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
-    write_event(fd, EV_ABS, ABS_MT_TRACKING_ID, -1);
-    if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)
-      write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
-    write_event(fd, EV_KEY, BTN_TOUCH, 0);
-    write_event(fd, EV_SYN, SYN_REPORT, 0);
-  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
-    write_event(fd, EV_KEY, BTN_TOUCH, 0);
-    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  drain_trace();
+  if (trace_format == TRACE_FORMAT_CHROME) {
+    fprintf(trace_out, "\n] }\n");
+    fclose(trace_out);
   }
-  print_action(ACTION_END, "release", NULL);
+  if (trace_dropped)
+    fprintf(stderr, "trace buffer overflowed, %u records dropped\n",
+            trace_dropped);
 }
 
-double timediff_msec(struct timespec *t1, struct timespec *t2)
+/* Nothing in a signal handler may touch stdio, so SIGINT and SIGTERM only
+   tell the writer, which finishes the trace and then lets the signal kill
+   us. --serve only ever stops this way. */
+void trace_signal_handler(int sig)
 {
-  return (((t2->tv_sec - t1->tv_sec) * 1000.0) +
-          1e-6 * (t2->tv_nsec - t1->tv_nsec));
+  trace_signal = sig;
 }
 
-void execute_drag(int fd, uint32_t device_flags, int start_x,
-                  int start_y, int end_x, int end_y, int num_steps,
-                  int duration_msec)
+void *trace_writer_main(void *arg)
 {
-  int delta[] = {(end_x-start_x)/num_steps, (end_y-start_y)/num_steps};
-  double desired_interval_msec, avg_event_dispatch_time_msec;
-  struct timespec start_time, current_time, time_before_last_move;
-  int i;
+  struct timespec interval;
+  int sig;
 
-  clock_gettime(CLOCK_MONOTONIC, &start_time);
-  double start_nsecs = (double) (start_time.tv_sec * (1000*1000)) + start_time.tv_nsec;
+  interval.tv_sec = 0;
+  interval.tv_nsec = TRACE_WRITER_INTERVAL_MSEC * NSEC_PER_MSEC;
 
-  print_action(ACTION_START, "drag", "\"start_x\": %d, \"start_y\": %d, "
-               "\"end_x\": %d, \"end_y\": %d, \"num_steps\": %d, "
-               "\"duration_msec\": %d", start_x, start_y, end_x, end_y,
-               num_steps, duration_msec);
+  while (!trace_writer_stop && !trace_signal) {
+    nanosleep(&interval, NULL);
+    drain_trace();
+  }
+  finish_trace();
 
-  // press
-  clock_gettime(CLOCK_MONOTONIC, &time_before_last_move);
-  execute_press(fd, device_flags, start_x, start_y);
+  sig = trace_signal;
+  if (sig) {
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+  return NULL;
+}
 
-  // drag
-  desired_interval_msec = duration_msec / num_steps;
-  for (i=0; i<num_steps; i++) {
-    clock_gettime(CLOCK_MONOTONIC, &current_time);
-    avg_event_dispatch_time_msec = ((avg_event_dispatch_time_msec * i) +
-                                    timediff_msec(&time_before_last_move,
-                                                  &current_time)) / i;
-    if (desired_interval_msec > 0 &&
-        avg_event_dispatch_time_msec < desired_interval_msec) {
-      execute_sleep(desired_interval_msec - avg_event_dispatch_time_msec);
-    }
+void stop_tracing(void)
+{
+  if (!print_actions)
+    return;
+  print_actions = 0;
+
+  trace_writer_stop = 1;
+  pthread_join(trace_writer, NULL);
+}
 
-    memcpy(&time_before_last_move, &current_time, sizeof(struct timespec));
-    execute_move(fd, device_flags, start_x+delta[0]*i, start_y+delta[1]*i);
+/* Start tracing to path in the Chrome trace-event format, or as JSON lines
+   on stdout if path is NULL. */
+int start_tracing(const char *path)
+{
+  if (path) {
+    trace_out = fopen(path, "w");
+    if (!trace_out) {
+      fprintf(stderr, "could not open %s, %s\n", path, strerror(errno));
+      return -1;
+    }
+    trace_format = TRACE_FORMAT_CHROME;
+    trace_pid = getpid();
+    fprintf(trace_out, "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+            "{ \"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"args\": { \"name\": \"orng\" } }", trace_pid);
+  } else {
+    trace_out = stdout;
   }
 
-  // release
-  execute_release(fd, device_flags);
+  trace_ring = (struct trace_record *)malloc(TRACE_RING_SIZE *
+                                             sizeof(struct trace_record));
+  if (!trace_ring) {
+    fprintf(stderr, "could not allocate trace buffer\n");
+    return -1;
+  }
+  // touch every page now rather than while tracing
+  memset(trace_ring, 0, TRACE_RING_SIZE * sizeof(struct trace_record));
 
-  // wait
-  execute_sleep(100);
+  if (pthread_create(&trace_writer, NULL, trace_writer_main, NULL) != 0) {
+    fprintf(stderr, "could not start trace writer\n");
+    return -1;
+  }
+  print_actions = 1;
 
-  print_action(ACTION_END, "drag", NULL);
+  // close the trace however we stop
+  signal(SIGINT, trace_signal_handler);
+  signal(SIGTERM, trace_signal_handler);
+  atexit(stop_tracing);
+  return 0;
 }
 
-void execute_tap(int fd, uint32_t device_flags, int x, int y,
-                 int num_times, int duration_msec)
-{
-  int i;
+/* How write_event()/flush_events() pace the events they emit. */
+enum {
+  PACING_NONE = 0,  /* emit as fast as possible */
+  PACING_FRAME = 1, /* sleep pacing_gap_usec before each frame */
+  PACING_EVENT = 2  /* sleep pacing_gap_usec before each event and write
+                       events one at a time, like orng used to */
+};
 
-  print_action(ACTION_START, "tap", "\"x\": %d, \"y\": %d, "
-               "\"num_times\": %d, \"duration_msec\": %d", x, y, num_times,
-               duration_msec);
+static int pacing_policy = PACING_FRAME;
+static int pacing_gap_usec = 1000;
 
-  for (i=0; i<num_times; i++) {
-    // press
-    execute_press(fd, device_flags, x, y);
-    execute_sleep(duration_msec);
+/* Frames emitted by execute_press, execute_move and execute_release. */
+enum {
+  FRAME_PRESS = 0,
+  FRAME_MOVE = 1,
+  FRAME_RELEASE = 2
+};
 
-    // release
-    execute_release(fd, device_flags);
-    execute_sleep(100);
+/* Number of events (including SYN_REPORT) in one of the frames above. */
+int frame_size(uint32_t device_flags, int frame)
+{
+  int n = 0;
 
-    // wait
-    execute_sleep(50);
+  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
+    if (frame == FRAME_PRESS)
+      n = 8;
+    else if (frame == FRAME_MOVE)
+      n = 6;
+    else
+      n = 3;
+    if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)
+      n++;
+  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
+    if (frame == FRAME_PRESS)
+      n = 4;
+    else if (frame == FRAME_MOVE)
+      n = 3;
+    else
+      n = 2;
   }
-
-  print_action(ACTION_END, "tap", NULL);
+  return n;
 }
 
-void execute_pinch(int fd, uint32_t device_flags, int touch1_x1,
-                   int touch1_y1, int touch1_x2, int touch1_y2, int touch2_x1,
-                   int touch2_y1, int touch2_x2, int touch2_y2, int num_steps,
-                   int duration_msec)
+/* Time the pacing policy adds to emitting a frame of num_events events, so
+   the gesture executors can plan around it. */
+int64_t pacing_nsec(int num_events)
 {
-  int delta1[] = {(touch1_x2-touch1_x1)/num_steps, (touch1_y2-touch1_y1)/num_steps};
-  int delta2[] = {(touch2_x2-touch2_x1)/num_steps, (touch2_y2-touch2_y1)/num_steps};
-  int sleeptime = duration_msec / num_steps;
-  int i;
-
-  print_action(ACTION_START, "pinch",
-               "\"touch1_x1\": %d, \"touch1_y1\": %d, \"touch1_x2\": %d, "
-               "\"touch1_y2\": %d, \"touch2_x1\": %d, \"touch2_y1\": %d, "
-               "\"touch2_x2\": %d, \"touch2_y2\": %d, \"num_steps\": %d, "
-               "\"duration_msec\": %d",
-               touch1_x1, touch1_y1, touch1_x2, touch1_y2,
-               touch2_x1, touch2_y1, touch2_x2, touch2_y2,
-               num_steps, duration_msec);
+  if (pacing_policy == PACING_FRAME)
+    return pacing_gap_usec * NSEC_PER_USEC;
+  if (pacing_policy == PACING_EVENT)
+    return num_events * pacing_gap_usec * NSEC_PER_USEC;
+  return 0;
+}
 
-  // press
-  change_mt_slot(fd, device_flags, 0);
-  execute_press(fd, device_flags, touch1_x1, touch1_y1);
+/* Benchmark mode reads the frames we inject back from the device and
+   compares the kernel's timestamp of each one with the time it was planned
+   to land at. */
+#define BENCH_READ_EVENTS 64
+#define BENCH_SETTLE_MSEC 200
 
-  change_mt_slot(fd, device_flags, 1);
-  execute_press(fd, device_flags, touch2_x1, touch2_y1);
+enum {
+  GESTURE_TAP = 0,
+  GESTURE_DRAG,
+  GESTURE_PINCH,
+  GESTURE_KEY,
+  GESTURE_RESET,
+  GESTURE_REPLAY,
+  GESTURE_SLEEP,
+  GESTURE_TOUCH, /* press, move and release commands */
+  GESTURE_CURVE, /* curve and spline commands */
+  GESTURE_ROTATE,
+  GESTURE_SWIPE,
+  GESTURE_STRESS,
+  GESTURE_PARALLEL,
+  NUM_GESTURES
+};
 
-  // drag
-  for (i=0; i<num_steps; i++) {
-    execute_sleep(sleeptime);
+static const char *gesture_names[NUM_GESTURES] = {
+  "tap", "drag", "pinch", "key", "reset", "replay", "sleep", "touch", "curve",
+  "rotate", "swipe", "stress", "parallel"
+};
 
-    change_mt_slot(fd, device_flags, 0);
-    execute_move(fd, device_flags, touch1_x1+delta1[0]*i, touch1_y1+delta1[1]*i);
+static int current_gesture = GESTURE_TAP;
 
-    change_mt_slot(fd, device_flags, 1);
-    execute_move(fd, device_flags, touch2_x1+delta2[0]*i, touch2_y1+delta2[1]*i);
+struct samples {
+  int64_t *values;
+  size_t count;
+  size_t capacity;
+};
 
-    //write_event(fd, EV_SYN, SYN_REPORT, 0);
+void samples_add(struct samples *samples, int64_t value)
+{
+  if (samples->count == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+    samples->values = (int64_t *)realloc(samples->values,
+                                         samples->capacity * sizeof(int64_t));
+    assert(samples->values);
   }
+  samples->values[samples->count++] = value;
+}
 
-  // release
-  change_mt_slot(fd, device_flags, 0);
-  execute_release(fd, device_flags);
+/* samples must be sorted */
+int64_t samples_percentile(const struct samples *samples, int percent)
+{
+  if (!samples->count)
+    return 0;
+  return samples->values[(samples->count - 1) * percent / 100];
+}
 
-  change_mt_slot(fd, device_flags, 1);
-  execute_release(fd, device_flags);
+/* The kernel drops a SYN_REPORT when it filtered every event of its frame as
+   unchanged, so frames don't come back one for one. Each planned frame keeps
+   the interval its SYN_REPORT was written in; the kernel stamps the event
+   inside that write, which is how read-back frames are matched up. */
+struct planned_frame {
+  int64_t nsec;
+  int64_t write_start_nsec;
+  int64_t write_end_nsec;
+  int gesture;
+};
 
-  // wait
-  execute_sleep(100);
+static int bench_fd = -1;
+static struct planned_frame *bench_planned = NULL;
+static size_t bench_num_planned = 0;
+static size_t bench_planned_capacity = 0;
+static size_t bench_num_written = 0;
+static size_t bench_num_matched = 0;
+static unsigned long bench_num_read = 0;
+static unsigned long bench_num_filtered = 0;
+static unsigned long bench_num_unknown = 0;
+static int bench_dropped = 0;
+static struct samples bench_latency[NUM_GESTURES];
 
-  print_action(ACTION_END, "pinch", NULL);
-}
+/* Deadline of the last wait, which the next frame was planned for. Frames
+   sent without waiting are planned for the moment they were started. */
+static int64_t wait_deadline_nsec = 0;
+static int64_t frame_start_nsec = 0;
 
-void execute_keyup(int fd, int key) {
-  write_event(fd, EV_KEY, key, 0);
+int open_bench_reader(const char *device)
+{
+  int clock_id = CLOCK_MONOTONIC;
+
+  bench_fd = open(device, O_RDONLY | O_NONBLOCK);
+  if (bench_fd < 0) {
+    fprintf(stderr, "could not open %s for reading, %s\n", device,
+            strerror(errno));
+    return -1;
+  }
+
+  if (ioctl(bench_fd, EVIOCSCLOCKID, &clock_id) < 0) {
+    fprintf(stderr, "could not switch %s to CLOCK_MONOTONIC, %s\n", device,
+            strerror(errno));
+    close(bench_fd);
+    bench_fd = -1;
+    return -1;
+  }
+  return 0;
 }
 
-void execute_keydown(int fd, int key) {
-  write_event(fd, EV_KEY, key, 1);
+void bench_plan_frame(int64_t planned_nsec)
+{
+  struct planned_frame *frame;
+
+  if (bench_num_planned == bench_planned_capacity) {
+    bench_planned_capacity = bench_planned_capacity ?
+      bench_planned_capacity * 2 : 4096;
+    bench_planned = (struct planned_frame *)
+      realloc(bench_planned, bench_planned_capacity * sizeof(*bench_planned));
+    assert(bench_planned);
+  }
+
+  frame = &bench_planned[bench_num_planned++];
+  frame->nsec = planned_nsec;
+  frame->write_start_nsec = 0;
+  frame->write_end_nsec = 0;
+  frame->gesture = current_gesture;
 }
 
-void execute_reset(int fd, uint32_t device_flags) {
-  print_action(ACTION_START, "reset", NULL);
-  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
-    write_event(fd, EV_ABS, ABS_MT_POSITION_X, 0);
-    write_event(fd, EV_ABS, ABS_MT_POSITION_Y, 0);
-    write_event(fd, EV_ABS, ABS_MT_PRESSURE, 0);
-    write_event(fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 0);
-    write_event(fd, EV_ABS, ABS_MT_WIDTH_MAJOR, 0);
-  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
-    write_event(fd, EV_ABS, ABS_X, 0);
-    write_event(fd, EV_ABS, ABS_Y, 0);
+/* Called after every write to the device; frames planned since the last one
+   had their SYN_REPORT in this write. */
+void bench_frame_written(int64_t start_nsec, int64_t end_nsec)
+{
+  for (; bench_num_written < bench_num_planned; bench_num_written++) {
+    bench_planned[bench_num_written].write_start_nsec = start_nsec;
+    bench_planned[bench_num_written].write_end_nsec = end_nsec;
   }
-  print_action(ACTION_END, "reset", NULL);
 }
 
-uint32_t figure_out_events_device_reports(int fd) {
+/* Match SYN_REPORTs read back from the device to the planned frame whose
+   write they were stamped in. Planned frames written before the stamp never
+   came back and were filtered by the kernel. Waits up to timeout_msec for the
+   first event. */
+void bench_read_back(int timeout_msec)
+{
+  struct input_event events[BENCH_READ_EVENTS];
+  struct pollfd pfd;
+  ssize_t ret;
+  int i;
 
-  uint32_t device_classes = 0;
+  if (bench_fd < 0 || bench_dropped)
+    return;
 
-  uint8_t key_bitmask[(KEY_MAX + 1) / 8 + !!((KEY_MAX + 1) % 8)];
-  uint8_t abs_bitmask[(ABS_MAX + 1) / 8 + !!((ABS_MAX + 1) % 8)];
+  pfd.fd = bench_fd;
+  pfd.events = POLLIN;
+  if (timeout_msec > 0 && poll(&pfd, 1, timeout_msec) <= 0)
+    return;
 
-  memset(key_bitmask, 0, sizeof(key_bitmask));
-  memset(abs_bitmask, 0, sizeof(abs_bitmask));
+  while ((ret = read(bench_fd, events, sizeof(events))) > 0) {
+    for (i=0; i<ret/(ssize_t)sizeof(events[0]); i++) {
+      struct planned_frame *frame;
+      int64_t nsec;
 
-  ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bitmask)), key_bitmask);
-  ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_bitmask)), abs_bitmask);
+      if (events[i].type != EV_SYN)
+        continue;
+      if (events[i].code == SYN_DROPPED) {
+        fprintf(stderr, "benchmark reader fell behind, results are "
+                "incomplete\n");
+        bench_dropped = 1;
+        return;
+      }
+      if (events[i].code != SYN_REPORT)
+        continue;
 
-  // See if this is a touch pad.
+      nsec = (int64_t)events[i].time.tv_sec * NSEC_PER_SEC +
+        (int64_t)events[i].time.tv_usec * NSEC_PER_USEC;
+      bench_num_read++;
+
+      while (bench_num_matched < bench_num_written &&
+             bench_planned[bench_num_matched].write_end_nsec < nsec) {
+        bench_num_matched++;
+        bench_num_filtered++;
+      }
+
+      // the kernel stamps in microseconds, so allow for the truncation
+      frame = bench_num_matched < bench_num_written ?
+        &bench_planned[bench_num_matched] : NULL;
+      if (!frame || frame->write_start_nsec - NSEC_PER_USEC > nsec) {
+        // not one of ours, e.g. a real touch on the same device
+        bench_num_unknown++;
+        continue;
+      }
+      bench_num_matched++;
+      samples_add(&bench_latency[frame->gesture], nsec - frame->nsec);
+    }
+  }
+}
+
+void print_bench_report(void)
+{
+  static const int64_t bucket_usec[] = {
+    0, 50, 100, 200, 500, 1000, 2000, 5000, 10000
+  };
+  const int num_buckets = sizeof(bucket_usec)/sizeof(bucket_usec[0]);
+  int i, j;
+  size_t k;
+
+  // give the last frames time to come back
+  while (bench_num_matched < bench_num_written && !bench_dropped) {
+    unsigned long read = bench_num_read;
+    bench_read_back(BENCH_SETTLE_MSEC);
+    if (read == bench_num_read)
+      break;
+  }
+  // whatever still hasn't come back was filtered too
+  if (!bench_dropped) {
+    bench_num_filtered += bench_num_written - bench_num_matched;
+    bench_num_matched = bench_num_written;
+  }
+
+  printf("injection latency: %lu frames planned, %lu read back, "
+         "%lu filtered by the kernel\n", (unsigned long)bench_num_planned,
+         bench_num_read - bench_num_unknown, bench_num_filtered);
+  if (bench_num_unknown)
+    printf("%lu frames read back were not ours\n", bench_num_unknown);
+  printf("%-8s %8s %10s %10s %10s %10s %10s\n", "gesture", "frames",
+         "p50_usec", "p99_usec", "max_usec", "mean_usec", "jitter_usec");
+
+  for (i=0; i<NUM_GESTURES; i++) {
+    struct samples *samples = &bench_latency[i];
+    double mean = 0, variance = 0;
+
+    if (!samples->count)
+      continue;
+
+    qsort(samples->values, samples->count, sizeof(int64_t), compare_int64);
+    for (k=0; k<samples->count; k++)
+      mean += samples->values[k];
+    mean /= samples->count;
+    for (k=0; k<samples->count; k++)
+      variance += (samples->values[k] - mean) * (samples->values[k] - mean);
+    variance /= samples->count;
+
+    printf("%-8s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", gesture_names[i],
+           (unsigned long)samples->count,
+           (double)samples_percentile(samples, 50) / NSEC_PER_USEC,
+           (double)samples_percentile(samples, 99) / NSEC_PER_USEC,
+           (double)samples_percentile(samples, 100) / NSEC_PER_USEC,
+           mean / NSEC_PER_USEC, sqrt(variance) / NSEC_PER_USEC);
+  }
+
+  for (i=0; i<NUM_GESTURES; i++) {
+    struct samples *samples = &bench_latency[i];
+    size_t counts[sizeof(bucket_usec)/sizeof(bucket_usec[0]) + 1];
+
+    if (!samples->count)
+      continue;
+
+    memset(counts, 0, sizeof(counts));
+    for (k=0; k<samples->count; k++) {
+      for (j=0; j<num_buckets &&
+             samples->values[k] >= bucket_usec[j] * NSEC_PER_USEC; j++)
+        ;
+      counts[j]++;
+    }
+
+    printf("\n%s latency histogram:\n", gesture_names[i]);
+    printf("  %14s %8lu\n", "< 0 usec", (unsigned long)counts[0]);
+    for (j=1; j<num_buckets; j++)
+      printf("  %5lld-%-5lld usec %8lu\n", (long long)bucket_usec[j-1],
+             (long long)bucket_usec[j], (unsigned long)counts[j]);
+    printf("  %9s%-5lld usec %8lu\n", ">= ", (long long)bucket_usec[num_buckets-1],
+           (unsigned long)counts[num_buckets]);
+  }
+}
+
+/* The timing report (-S) compares every command with what it was planned to
+   do: how long it took against how long it should have taken, how far the
+   interval between each of its frames was from the planned interval, and how
+   many frames were written late. */
+#define MISSED_DEADLINE_NSEC (500 * NSEC_PER_USEC)
+
+struct gesture_stats {
+  unsigned long count;
+  int64_t planned_nsec;
+  int64_t actual_nsec;
+  int64_t max_drift_nsec; /* worst difference between actual and planned */
+  struct samples interval_error;
+  unsigned long missed;
+  unsigned long events;
+  unsigned long syscalls;
+};
+
+static int print_stats = 0;
+static int report_lateness = 0; /* print how late each replayed frame was */
+static struct gesture_stats stats[NUM_GESTURES];
+static unsigned long num_events_written = 0;
+// the previous frame of the current command, planned and actual time
+static int64_t stats_last_planned_nsec = -1;
+static int64_t stats_last_actual_nsec = -1;
+static unsigned long stats_start_events = 0;
+static unsigned long stats_start_syscalls = 0;
+
+void stats_start_command(void)
+{
+  stats_last_planned_nsec = -1;
+  stats_last_actual_nsec = -1;
+  stats_start_events = num_events_written;
+  stats_start_syscalls = num_syscalls;
+}
+
+void stats_end_command(int gesture, int64_t planned_nsec, int64_t start_nsec)
+{
+  struct gesture_stats *g = &stats[gesture];
+  int64_t actual_nsec = now_nsec() - start_nsec;
+  int64_t drift_nsec = llabs(actual_nsec - planned_nsec);
+
+  if (!print_stats)
+    return;
+
+  g->count++;
+  g->planned_nsec += planned_nsec;
+  g->actual_nsec += actual_nsec;
+  if (drift_nsec > g->max_drift_nsec)
+    g->max_drift_nsec = drift_nsec;
+  g->events += num_events_written - stats_start_events;
+  g->syscalls += num_syscalls - stats_start_syscalls;
+}
+
+/* Record that a frame planned for planned_nsec has just been written. */
+void stats_frame(int64_t planned_nsec)
+{
+  struct gesture_stats *g = &stats[current_gesture];
+  int64_t actual_nsec;
+
+  if (!print_stats)
+    return;
+
+  actual_nsec = now_nsec();
+  if (actual_nsec - planned_nsec > MISSED_DEADLINE_NSEC)
+    g->missed++;
+  if (stats_last_actual_nsec >= 0)
+    samples_add(&g->interval_error,
+                llabs((actual_nsec - stats_last_actual_nsec) -
+                      (planned_nsec - stats_last_planned_nsec)));
+  stats_last_planned_nsec = planned_nsec;
+  stats_last_actual_nsec = actual_nsec;
+}
+
+/* Print the timing report, and return how many gestures drifted from their
+   plan by more than max_drift_usec, if it's set. */
+int print_stats_report(int max_drift_usec)
+{
+  int i, over = 0;
+  size_t k;
+
+  printf("%-8s %6s %11s %11s %10s %11s %11s %11s %7s %8s %8s\n", "gesture",
+         "count", "planned_ms", "actual_ms", "drift_usec", "err_mean_us",
+         "err_p99_us", "err_max_us", "missed", "events", "syscalls");
+
+  for (i=0; i<NUM_GESTURES; i++) {
+    struct gesture_stats *g = &stats[i];
+    struct samples *errors = &g->interval_error;
+    double mean = 0;
+    int64_t max_error;
+
+    if (!g->count)
+      continue;
+
+    qsort(errors->values, errors->count, sizeof(int64_t), compare_int64);
+    for (k=0; k<errors->count; k++)
+      mean += errors->values[k];
+    if (errors->count)
+      mean /= errors->count;
+    max_error = samples_percentile(errors, 100);
+
+    printf("%-8s %6lu %11.1f %11.1f %10.1f %11.1f %11.1f %11.1f %7lu %8lu "
+           "%8lu\n", gesture_names[i], g->count,
+           (double)g->planned_nsec / NSEC_PER_MSEC,
+           (double)g->actual_nsec / NSEC_PER_MSEC,
+           (double)g->max_drift_nsec / NSEC_PER_USEC, mean / NSEC_PER_USEC,
+           (double)samples_percentile(errors, 99) / NSEC_PER_USEC,
+           (double)max_error / NSEC_PER_USEC, g->missed, g->events,
+           g->syscalls);
+
+    if (max_drift_usec > 0 &&
+        (g->max_drift_nsec > max_drift_usec * NSEC_PER_USEC ||
+         max_error > max_drift_usec * NSEC_PER_USEC)) {
+      fprintf(stderr, "%s drifted more than %d usec from its plan\n",
+              gesture_names[i], max_drift_usec);
+      over++;
+    }
+  }
+  return over;
+}
+
+/* Events are queued until the SYN_REPORT that ends their frame, so that the
+   kernel receives a whole frame with a single write() the way a digitizer's
+   interrupt handler would deliver it. */
+#define MAX_FRAME_EVENTS 256
+
+static struct input_event frame_events[MAX_FRAME_EVENTS];
+static int frame_num_events = 0;
+// events queued since the last SYN_REPORT, across flushes
+static int frame_total_events = 0;
+
+/* Compiled scripts (.orngb) are a frame log: a header followed by every
+   frame the script emits, each with its offset from the start of the script,
+   so that replaying one does nothing but sleep and write. Fields are in host
+   byte order, which is little-endian on everything we run on. */
+#define FRAME_LOG_MAGIC "ORNG"
+#define FRAME_LOG_VERSION 1
+
+enum {
+  FRAME_LOG_COMPILED = 1,
+  FRAME_LOG_RECORDED = 2 /* captured from a device with --record */
+};
+
+struct frame_log_header {
+  char magic[4];
+  uint8_t version;
+  uint8_t kind;
+  uint16_t reserved;
+  uint32_t device_flags;
+  uint32_t num_frames;
+  uint64_t duration_nsec;
+};
+
+struct frame_log_frame {
+  uint64_t offset_nsec;
+  uint32_t num_events;
+  uint32_t reserved;
+};
+
+/* struct input_event's size depends on the ABI, so logs carry this instead */
+struct frame_log_event {
+  uint16_t type;
+  uint16_t code;
+  int32_t value;
+};
+
+static FILE *compile_out = NULL;
+static uint32_t compile_num_frames = 0;
+
+int write_fully(int fd, const void *data, size_t len)
+{
+  ssize_t ret = 0;
+  const unsigned char *buf = (const unsigned char*)data;
+  ssize_t buflen = (ssize_t)len;
+
+  do {
+    ret = write(fd, buf, buflen);
+    if (ret > 0) {
+      buf += ret;
+      buflen -= ret;
+    }
+  } while (((ret >= 0) && buflen) || ((ret < 0) && (errno == EINTR)));
+
+  return ret < 0 ? -1 : 0;
+}
+
+void write_frame(int fd, const struct input_event *events, int num_events)
+{
+  num_syscalls++;
+  if (write_fully(fd, events, num_events * sizeof(struct input_event)) < 0)
+    fprintf(stderr, "write event failed, %s\n", strerror(errno));
+}
+
+void log_frame(FILE *out, int64_t offset_nsec,
+               const struct input_event *events, int num_events)
+{
+  struct frame_log_frame frame;
+  struct frame_log_event event;
+  int i;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.offset_nsec = offset_nsec;
+  frame.num_events = num_events;
+  fwrite(&frame, sizeof(frame), 1, out);
+
+  for (i=0; i<num_events; i++) {
+    event.type = events[i].type;
+    event.code = events[i].code;
+    event.value = events[i].value;
+    fwrite(&event, sizeof(event), 1, out);
+  }
+}
+
+void compile_frame(int fd, const struct input_event *events, int num_events)
+{
+  log_frame(compile_out, now_nsec(), events, num_events);
+  compile_num_frames++;
+}
+
+void discard_frame(int fd, const struct input_event *events, int num_events)
+{
+}
+
+/* Where frames go. The device and file sinks write them to an fd, an input
+   device or a file or pipe of raw input_event records; the null sink drops
+   them and the log sink adds them to a compiled script. Every sink counts
+   what it's sent, so that with the null sink and --clock none a run shows
+   what generating each event costs. */
+struct sink {
+  const char *name;
+  void (*write_frame)(int fd, const struct input_event *events,
+                      int num_events);
+};
+
+static const struct sink device_sink = { "device", write_frame };
+static const struct sink file_sink = { "file", write_frame };
+static const struct sink null_sink = { "null", discard_frame };
+static const struct sink log_sink = { "log", compile_frame };
+
+static const struct sink *sink = &device_sink;
+static unsigned long sink_num_frames = 0;
+static unsigned long sink_num_events = 0;
+
+void send_frame(int fd, struct input_event *events, int num_events)
+{
+  int64_t nsec;
+  int i;
+
+  // the kernel stamps events with the real clock; with a virtual clock,
+  // stamp them here so a file sink gets the simulated timeline
+  if (clock_mode == CLOCK_MODE_VIRTUAL) {
+    nsec = now_nsec();
+    for (i=0; i<num_events; i++) {
+      events[i].time.tv_sec = nsec / NSEC_PER_SEC;
+      events[i].time.tv_usec = (nsec % NSEC_PER_SEC) / NSEC_PER_USEC;
+    }
+  }
+
+  if (bench_fd >= 0) {
+    nsec = now_nsec();
+    sink->write_frame(fd, events, num_events);
+    bench_frame_written(nsec, now_nsec());
+  } else {
+    sink->write_frame(fd, events, num_events);
+  }
+  sink_num_frames++;
+  sink_num_events += num_events;
+}
+
+int64_t cpu_nsec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void print_sink_report(int64_t cpu_used_nsec, int64_t wall_nsec)
+{
+  printf("%s sink: %lu frames, %lu events in %.3f msec\n", sink->name,
+         sink_num_frames, sink_num_events, (double)wall_nsec / NSEC_PER_MSEC);
+  printf("cpu: %.3f msec, %.1f nsec per event, %.1f nsec per frame\n",
+         (double)cpu_used_nsec / NSEC_PER_MSEC,
+         sink_num_events ? (double)cpu_used_nsec / sink_num_events : 0.0,
+         sink_num_frames ? (double)cpu_used_nsec / sink_num_frames : 0.0);
+}
+
+void flush_events(int fd)
+{
+  int num_events = frame_num_events;
+
+  if (!num_events)
+    return;
+  frame_num_events = 0;
+
+  if (pacing_policy == PACING_FRAME && pacing_gap_usec > 0)
+    sleep_until(now_nsec() + pacing_gap_usec * NSEC_PER_USEC);
+
+  send_frame(fd, frame_events, num_events);
+}
+
+void write_event(int fd, int type, int code, int value)
+{
+  struct input_event *event;
+  int64_t planned_nsec = 0;
+  int num_events;
+
+  if (pacing_policy == PACING_EVENT && pacing_gap_usec > 0)
+    sleep_until(now_nsec() + pacing_gap_usec * NSEC_PER_USEC);
+
+  // never split a frame silently; a frame this large is a bug in the caller
+  assert(frame_num_events < MAX_FRAME_EVENTS);
+
+  event = &frame_events[frame_num_events++];
+  memset(event, 0, sizeof(*event));
+
+  event->type = type;
+  event->code = code;
+  event->value = value;
+  num_events_written++;
+
+  if ((bench_fd >= 0 || print_actions || print_stats) &&
+      !frame_total_events++)
+    frame_start_nsec = now_nsec();
+
+  if (type == EV_SYN && code == SYN_REPORT) {
+    planned_nsec = (wait_deadline_nsec ? wait_deadline_nsec :
+                    frame_start_nsec) + pacing_nsec(frame_total_events);
+    if (bench_fd >= 0)
+      bench_plan_frame(planned_nsec);
+    num_events = frame_total_events;
+    frame_total_events = 0;
+    wait_deadline_nsec = 0;
+    flush_events(fd);
+    trace_frame(num_events, planned_nsec);
+    stats_frame(planned_nsec);
+  } else if (pacing_policy == PACING_EVENT) {
+    flush_events(fd);
+  }
+}
+
+/* With precise waits, sleep_until() is only trusted to get us within
+   spin_margin_nsec of a deadline and we spin on the clock for the rest.
+   calibrate_wait() sizes the margin from the wakeup latency it measures. */
+#define CALIBRATION_ROUNDS 64
+#define CALIBRATION_SLEEP_NSEC (1 * NSEC_PER_MSEC)
+#define MAX_SPIN_MARGIN_NSEC (2 * NSEC_PER_MSEC)
+
+/* Wakeups later than this are reported in the trace as scheduling outliers. */
+#define LATE_WAKEUP_NSEC (500 * NSEC_PER_USEC)
+
+static int precise_waits = 0;
+static int64_t spin_margin_nsec = 0;
+
+void calibrate_wait(void)
+{
+  int64_t latency[CALIBRATION_ROUNDS];
+  int64_t deadline;
+  int timer_slack;
+  int i;
+
+  timer_slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+
+  for (i=0; i<CALIBRATION_ROUNDS; i++) {
+    deadline = now_nsec() + CALIBRATION_SLEEP_NSEC;
+    sleep_until(deadline);
+    latency[i] = now_nsec() - deadline;
+  }
+  qsort(latency, CALIBRATION_ROUNDS, sizeof(latency[0]), compare_int64);
+
+  // the worst wakeup we saw, with a bit of headroom for ones we didn't
+  spin_margin_nsec = latency[CALIBRATION_ROUNDS-1] +
+    latency[CALIBRATION_ROUNDS-1] / 4;
+  if (spin_margin_nsec > MAX_SPIN_MARGIN_NSEC)
+    spin_margin_nsec = MAX_SPIN_MARGIN_NSEC;
+
+  fprintf(stderr, "wait calibration: timer slack %d ns, wakeup latency "
+          "min %lld ns, median %lld ns, max %lld ns, spin margin %lld ns\n",
+          timer_slack, (long long)latency[0],
+          (long long)latency[CALIBRATION_ROUNDS/2],
+          (long long)latency[CALIBRATION_ROUNDS-1],
+          (long long)spin_margin_nsec);
+}
+
+/* Real-time mode: keep orng from being preempted or paged out partway
+   through a gesture. */
+#define PREFAULT_STACK_SIZE (256 * 1024)
+#define MAX_CPUS 1024
+
+void prefault_stack(void)
+{
+  volatile char stack[PREFAULT_STACK_SIZE];
+  size_t i;
+
+  for (i=0; i<sizeof(stack); i+=4096)
+    stack[i] = 0;
+}
+
+int enter_realtime(int priority, int cpu)
+{
+  struct sched_param param;
+
+  if (cpu >= 0) {
+    unsigned long mask[MAX_CPUS / (8 * sizeof(unsigned long))];
+
+    if (cpu >= MAX_CPUS) {
+      fprintf(stderr, "invalid cpu %d\n", cpu);
+      return -1;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / (8 * sizeof(unsigned long))] |=
+      1ul << (cpu % (8 * sizeof(unsigned long)));
+    // use the syscall, older bionic has no cpu_set_t
+    if (syscall(__NR_sched_setaffinity, 0, sizeof(mask), mask) < 0) {
+      fprintf(stderr, "could not pin to cpu %d, %s\n", cpu, strerror(errno));
+      return -1;
+    }
+  }
+
+  if (priority > 0) {
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+      fprintf(stderr, "could not switch to SCHED_FIFO, %s\n", strerror(errno));
+      return -1;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      fprintf(stderr, "could not lock memory, %s\n", strerror(errno));
+      return -1;
+    }
+
+    // timer slack is ignored for real-time tasks on newer kernels, but not
+    // on all of the ones we run on
+    if (prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0) < 0)
+      fprintf(stderr, "could not set timer slack, %s\n", strerror(errno));
+
+    // fault in everything the hot path touches before the first gesture
+    prefault_stack();
+    memset(frame_events, 0, sizeof(frame_events));
+  }
+
+  return 0;
+}
+
+/* Wait until deadline_nsec, spinning through the end of the wait if precise
+   waits are enabled. */
+void wait_until(int64_t deadline_nsec)
+{
+  int64_t late_nsec;
+
+  // the last frame is out, read it back while we have time to spare
+  bench_read_back(0);
+  wait_deadline_nsec = deadline_nsec;
+
+  if (clock_mode == CLOCK_MODE_NONE)
+    return;
+
+  if (!precise_waits || clock_mode != CLOCK_MODE_REAL) {
+    sleep_until(deadline_nsec);
+  } else {
+    if (deadline_nsec - spin_margin_nsec > now_nsec())
+      sleep_until(deadline_nsec - spin_margin_nsec);
+    while (now_nsec() < deadline_nsec)
+      ;
+  }
+
+  // we were most likely preempted, let the trace show where
+  late_nsec = now_nsec() - deadline_nsec;
+  if (late_nsec > LATE_WAKEUP_NSEC)
+    print_action(ACTION_MARK, TRACE_LATE_WAKEUP,
+                 (int)(late_nsec / NSEC_PER_USEC));
+}
+
+void execute_sleep_until(int64_t deadline_nsec)
+{
+  print_action(ACTION_START, TRACE_SLEEP,
+               (int)((deadline_nsec - now_nsec()) / NSEC_PER_USEC));
+  wait_until(deadline_nsec);
+  print_action(ACTION_END, TRACE_SLEEP);
+}
+
+void execute_sleep(int duration_msec)
+{
+  execute_sleep_until(now_nsec() + duration_msec * NSEC_PER_MSEC);
+}
+
+/* The slot the device was last told about, -1 if we don't know */
+static int mt_slot = -1;
+
+void change_mt_slot(int fd, uint32_t device_flags, int slot)
+{
+  write_event(fd, EV_ABS, ABS_MT_SLOT, slot);
+  mt_slot = slot;
+}
+
+void execute_press(int fd, uint32_t device_flags, int x, int y)
+{
+  print_action(ACTION_START, TRACE_PRESS, x, y);
+  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
+    write_event(fd, EV_ABS, ABS_MT_TRACKING_ID, global_tracking_id++);
+    write_event(fd, EV_ABS, ABS_MT_POSITION_X, x);
+    write_event(fd, EV_ABS, ABS_MT_POSITION_Y, y);
+    write_event(fd, EV_ABS, ABS_MT_PRESSURE, 127);
+    write_event(fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 127);
+    write_event(fd, EV_ABS, ABS_MT_WIDTH_MAJOR, 4);
+    if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)
+      write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
+    write_event(fd, EV_KEY, BTN_TOUCH, 1);
+    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
+    write_event(fd, EV_ABS, ABS_X, x);
+    write_event(fd, EV_ABS, ABS_Y, y);
+    write_event(fd, EV_KEY, BTN_TOUCH, 1);
+    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  }
+  print_action(ACTION_END, TRACE_PRESS);
+}
+
+void execute_move(int fd, uint32_t device_flags, int x, int y)
+{
+  print_action(ACTION_START, TRACE_MOVE, x, y);
+  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
+    write_event(fd, EV_ABS, ABS_MT_POSITION_X, x);
+    write_event(fd, EV_ABS, ABS_MT_POSITION_Y, y);
+    write_event(fd, EV_ABS, ABS_MT_PRESSURE, 127);
+    write_event(fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 127);
+    write_event(fd, EV_ABS, ABS_MT_WIDTH_MAJOR, 4);
+    if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)
+      write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
+    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
+    write_event(fd, EV_ABS, ABS_X, x);
+    write_event(fd, EV_ABS, ABS_Y, y);
+    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  }
+  print_action(ACTION_END, TRACE_MOVE);
+}
+
+void execute_release(int fd, uint32_t device_flags)
+{
+  print_action(ACTION_START, TRACE_RELEASE);
+  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
+    write_event(fd, EV_ABS, ABS_MT_TRACKING_ID, -1);
+    if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)
+      write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
+    write_event(fd, EV_KEY, BTN_TOUCH, 0);
+    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
+    write_event(fd, EV_KEY, BTN_TOUCH, 0);
+    write_event(fd, EV_SYN, SYN_REPORT, 0);
+  }
+  print_action(ACTION_END, TRACE_RELEASE);
+}
+
+/* Gesture paths are tables of points, one per frame, worked out before the
+   finger goes down. Points are interpolated in 16.16 fixed point and rounded
+   once, so rounding doesn't build up over the steps of a gesture and the
+   last point is exactly the end point. */
+#define FIXED_SHIFT 16
+#define FIXED_ONE ((int64_t)1 << FIXED_SHIFT)
+#define FIXED_HALF (FIXED_ONE / 2)
+
+struct point {
+  int x, y;
+};
+
+int interpolate(int start, int end, int step, int num_steps)
+{
+  // coordinates can be negative, so scale by multiplying rather than
+  // shifting, and round down the same way for either sign
+  int64_t fixed = start * FIXED_ONE +
+    (int64_t)(end - start) * FIXED_ONE * step / num_steps + FIXED_HALF;
+
+  if (fixed < 0)
+    return (int)-((-fixed + FIXED_ONE - 1) / FIXED_ONE);
+  return (int)(fixed / FIXED_ONE);
+}
+
+/* Fill path with the num_steps points after (x1, y1) on the line to
+   (x2, y2). */
+void line_path(struct point *path, int x1, int y1, int x2, int y2,
+               int num_steps)
+{
+  int i;
+
+  for (i=0; i<num_steps; i++) {
+    path[i].x = interpolate(x1, x2, i+1, num_steps);
+    path[i].y = interpolate(y1, y2, i+1, num_steps);
+  }
+}
+
+/* How a drag covers its distance over time. Moves still go out at even
+   intervals, the profile only decides how far along the line each one is.
+   A fling accelerates from rest and lifts off at a given speed; stop slows
+   down to rest on the end point and can wait there before lifting. */
+enum {
+  PROFILE_LINEAR = 0,
+  PROFILE_EASE,
+  PROFILE_FLING,
+  PROFILE_STOP
+};
+
+/* Fraction of the distance covered at time u, from 0 to 1. v is the lift-off
+   speed of a fling, relative to the average speed of the drag. */
+double profile_position(int profile, double u, double v)
+{
+  switch (profile) {
+  case PROFILE_EASE:
+    return u*u * (3 - 2*u);
+  case PROFILE_FLING:
+    // starts at rest and ends with speed v; beyond 3 the cubic would go
+    // backwards, so rest for the first part and cover the distance with u^3
+    // in the rest of the time instead
+    if (v < 0)
+      v = 0;
+    if (v > 3) {
+      double rest = 1 - 3 / v;
+      if (u <= rest)
+        return 0;
+      u = (u - rest) / (1 - rest);
+      return u*u*u;
+    }
+    return (3 - v)*u*u + (v - 2)*u*u*u;
+  case PROFILE_STOP:
+    return 1 - (1-u)*(1-u)*(1-u);
+  }
+  return u;
+}
+
+/* Like line_path(), with the points placed along the line by a velocity
+   profile. velocity is the lift-off speed of a fling in px per second. */
+void profile_path(struct point *path, int x1, int y1, int x2, int y2,
+                  int num_steps, int duration_msec, int profile,
+                  int velocity)
+{
+  double distance = hypot(x2 - x1, y2 - y1);
+  double v = 0, f;
+  int i;
+
+  if (profile == PROFILE_LINEAR) {
+    line_path(path, x1, y1, x2, y2, num_steps);
+    return;
+  }
+
+  if (distance > 0)
+    v = (double)velocity * duration_msec / 1000 / distance;
+  for (i=0; i<num_steps; i++) {
+    f = profile_position(profile, (double)(i+1) / num_steps, v);
+    path[i].x = x1 + (int)lround((x2 - x1) * f);
+    path[i].y = y1 + (int)lround((y2 - y1) * f);
+  }
+}
+
+struct point *alloc_path(int num_steps)
+{
+  struct point *path = (struct point *)malloc(num_steps * sizeof(*path));
+
+  assert(path);
+  return path;
+}
+
+/* Move the finger in the current slot along path, one point per frame
+   deadline, spread evenly over duration_msec from start_nsec. */
+void execute_path(int fd, uint32_t device_flags, const struct point *path,
+                  int num_steps, int64_t start_nsec, int duration_msec)
+{
+  // wake up early by what the pacing policy adds to each move
+  int64_t move_pacing_nsec = pacing_nsec(frame_size(device_flags, FRAME_MOVE));
+  int i;
+
+  for (i=0; i<num_steps; i++) {
+    execute_sleep_until(start_nsec + (int64_t)(i+1) * duration_msec *
+                        NSEC_PER_MSEC / num_steps - move_pacing_nsec);
+    execute_move(fd, device_flags, path[i].x, path[i].y);
+  }
+}
+
+/* Fill path with the num_steps points after the first control point on a
+   quadratic (3 control points) or cubic (4) Bezier curve. points holds x, y
+   pairs. */
+void bezier_path(struct point *path, const int *points, int num_points,
+                 int num_steps)
+{
+  double t, u, w[4], x, y;
+  int i, j;
+
+  for (i=0; i<num_steps; i++) {
+    t = (double)(i+1) / num_steps;
+    u = 1 - t;
+    if (num_points == 3) {
+      w[0] = u*u;
+      w[1] = 2*u*t;
+      w[2] = t*t;
+    } else {
+      w[0] = u*u*u;
+      w[1] = 3*u*u*t;
+      w[2] = 3*u*t*t;
+      w[3] = t*t*t;
+    }
+    for (j=0, x=0, y=0; j<num_points; j++) {
+      x += w[j] * points[2*j];
+      y += w[j] * points[2*j+1];
+    }
+    path[i].x = (int)lround(x);
+    path[i].y = (int)lround(y);
+  }
+}
+
+/* Fill path with the num_steps points after the first control point on a
+   uniform Catmull-Rom spline through all of them. The steps are spread
+   evenly over the segments between control points. */
+void catmull_rom_path(struct point *path, const int *points, int num_points,
+                      int num_steps)
+{
+  int num_segments = num_points - 1;
+  const int *p0, *p1, *p2, *p3;
+  double t, u;
+  int i, j, segment;
+
+  for (i=0; i<num_steps; i++) {
+    t = (double)(i+1) * num_segments / num_steps;
+    segment = (int)t;
+    if (segment == num_segments)
+      segment--;
+    u = t - segment;
+
+    // the end points stand in for the missing neighbours of the ends
+    p0 = points + 2 * (segment > 0 ? segment - 1 : 0);
+    p1 = points + 2 * segment;
+    p2 = points + 2 * (segment + 1);
+    p3 = points + 2 * (segment + 2 < num_points ? segment + 2 : segment + 1);
+    for (j=0; j<2; j++) {
+      double v = 0.5 * (2*p1[j] + (p2[j] - p0[j]) * u +
+                        (2*p0[j] - 5*p1[j] + 4*p2[j] - p3[j]) * u*u +
+                        (3*p1[j] - p0[j] - 3*p2[j] + p3[j]) * u*u*u);
+      if (j)
+        path[i].y = (int)lround(v);
+      else
+        path[i].x = (int)lround(v);
+    }
+  }
+}
+
+/* Press at x, y, follow path, hold still for hold_msec, release and wait a
+   little. */
+void execute_stroke(int fd, uint32_t device_flags, int x, int y,
+                    const struct point *path, int num_steps,
+                    int duration_msec, int hold_msec)
+{
+  int64_t start_nsec, release_nsec;
+
+  // press
+  start_nsec = now_nsec();
+  execute_press(fd, device_flags, x, y);
+
+  // drag, one move per frame deadline
+  execute_path(fd, device_flags, path, num_steps, start_nsec, duration_msec);
+  if (hold_msec)
+    execute_sleep_until(start_nsec + (duration_msec + hold_msec) *
+                        NSEC_PER_MSEC);
+
+  // release
+  execute_release(fd, device_flags);
+  release_nsec = now_nsec();
+
+  // wait
+  execute_sleep_until(release_nsec + 100 * NSEC_PER_MSEC);
+}
+
+/* profile_arg is the lift-off speed of a fling, or how long to hold still
+   at the end of a stop. */
+void execute_drag(int fd, uint32_t device_flags, int start_x,
+                  int start_y, int end_x, int end_y, int num_steps,
+                  int duration_msec, int profile, int profile_arg)
+{
+  struct point *path = alloc_path(num_steps);
+
+  print_action(ACTION_START, TRACE_DRAG, start_x, start_y, end_x, end_y,
+               num_steps, duration_msec, profile, profile_arg);
+
+  profile_path(path, start_x, start_y, end_x, end_y, num_steps,
+               duration_msec, profile, profile_arg);
+  execute_stroke(fd, device_flags, start_x, start_y, path, num_steps,
+                 duration_msec, profile == PROFILE_STOP ? profile_arg : 0);
+
+  print_action(ACTION_END, TRACE_DRAG);
+  free(path);
+}
+
+/* A Bezier curve, or with spline set, a Catmull-Rom spline through
+   points. */
+void curve_path(struct point *path, int spline, const int *points,
+                int num_points, int num_steps)
+{
+  const int *end = points + 2 * (num_points - 1);
+
+  if (spline)
+    catmull_rom_path(path, points, num_points, num_steps);
+  else
+    bezier_path(path, points, num_points, num_steps);
+  // both curves end on the last control point, make sure rounding agrees
+  path[num_steps-1].x = end[0];
+  path[num_steps-1].y = end[1];
+}
+
+void execute_curve(int fd, uint32_t device_flags, int spline,
+                   const int *points, int num_points, int num_steps,
+                   int duration_msec)
+{
+  struct point *path = alloc_path(num_steps);
+  const int *end = points + 2 * (num_points - 1);
+
+  print_action(ACTION_START, TRACE_CURVE, points[0], points[1], end[0],
+               end[1], num_points, num_steps, duration_msec);
+
+  curve_path(path, spline, points, num_points, num_steps);
+
+  execute_stroke(fd, device_flags, points[0], points[1], path, num_steps,
+                 duration_msec, 0);
+
+  print_action(ACTION_END, TRACE_CURVE);
+  free(path);
+}
+
+void execute_tap(int fd, uint32_t device_flags, int x, int y,
+                 int num_times, int duration_msec)
+{
+  int64_t press_nsec;
+  int64_t release_pacing_nsec =
+    pacing_nsec(frame_size(device_flags, FRAME_RELEASE));
+  int i;
+
+  print_action(ACTION_START, TRACE_TAP, x, y, num_times, duration_msec);
+
+  press_nsec = now_nsec();
+  for (i=0; i<num_times; i++) {
+    // press
+    execute_press(fd, device_flags, x, y);
+    execute_sleep_until(press_nsec + duration_msec * NSEC_PER_MSEC -
+                        release_pacing_nsec);
+
+    // release
+    execute_release(fd, device_flags);
+
+    // wait, then start the next tap 150 ms after this release
+    press_nsec += (duration_msec + 150) * NSEC_PER_MSEC;
+    execute_sleep_until(press_nsec);
+  }
+
+  print_action(ACTION_END, TRACE_TAP);
+}
+
+/* Multi-touch engine. A gesture with several fingers works out the path of
+   every finger up front, then presses, moves and releases them all together,
+   one frame per tick, the way a touchscreen reports them. Fingers take the
+   lowest free slots, up to what the device's ABS_MT_SLOT goes up to. Devices
+   that need MT_SYNC list every finger that is down in each frame instead,
+   and single-touch devices only get the first finger. */
+#define MAX_FINGERS 16
+#define DEFAULT_MT_SLOTS 10
+#define MAX_MT_SLOTS 32
+
+static int num_mt_slots = DEFAULT_MT_SLOTS;
+static uint32_t mt_slots_used = 0;
+
+/* Where the last press or move command left the finger */
+static int touch_x = 0, touch_y = 0;
+
+struct finger {
+  int slot;
+  int x, y;                /* where it goes down */
+  const struct point *path;
+};
+
+/* maximum is the maximum of ABS_MT_SLOT. */
+void set_mt_slots(int maximum)
+{
+  num_mt_slots = maximum + 1;
+  if (num_mt_slots < 1)
+    num_mt_slots = 1;
+  else if (num_mt_slots > MAX_MT_SLOTS)
+    num_mt_slots = MAX_MT_SLOTS;
+}
+
+int alloc_mt_slot(void)
+{
+  int slot;
+
+  for (slot=0; slot<num_mt_slots; slot++) {
+    if (!(mt_slots_used & (1u << slot))) {
+      mt_slots_used |= 1u << slot;
+      return slot;
+    }
+  }
+  return -1;
+}
+
+void free_mt_slot(int slot)
+{
+  mt_slots_used &= ~(1u << slot);
+}
+
+void write_finger(int fd, uint32_t device_flags, int x, int y, int press)
+{
+  if (press)
+    write_event(fd, EV_ABS, ABS_MT_TRACKING_ID, global_tracking_id++);
+  write_event(fd, EV_ABS, ABS_MT_POSITION_X, x);
+  write_event(fd, EV_ABS, ABS_MT_POSITION_Y, y);
+  write_event(fd, EV_ABS, ABS_MT_PRESSURE, 127);
+  write_event(fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 127);
+  write_event(fd, EV_ABS, ABS_MT_WIDTH_MAJOR, 4);
+}
+
+/* MT_SYNC frames list every contact that is down, including the finger a
+   press command holds in slot 0. */
+void write_held_contact(int fd, uint32_t device_flags)
+{
+  write_finger(fd, device_flags, touch_x, touch_y, 0);
+  write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
+}
+
+/* Write one frame that presses, moves or releases every finger, with
+   positions[i] being where finger i is. */
+void write_touches(int fd, uint32_t device_flags, const struct finger *fingers,
+                   const struct point *positions, int num_fingers, int frame)
+{
+  uint32_t others;
+  int i;
+
+  // fingers that are down but not part of this gesture
+  for (i=0, others=mt_slots_used; i<num_fingers; i++)
+    others &= ~(1u << fingers[i].slot);
+
+  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC) {
+    if (others & 1)
+      write_held_contact(fd, device_flags);
+    for (i=0; i<num_fingers && frame != FRAME_RELEASE; i++) {
+      write_finger(fd, device_flags, positions[i].x, positions[i].y,
+                   frame == FRAME_PRESS);
+      write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
+    }
+    if (frame == FRAME_RELEASE && !(others & 1))
+      write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
+  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
+    for (i=0; i<num_fingers; i++) {
+      if (fingers[i].slot != mt_slot)
+        change_mt_slot(fd, device_flags, fingers[i].slot);
+      if (frame == FRAME_RELEASE)
+        write_event(fd, EV_ABS, ABS_MT_TRACKING_ID, -1);
+      else
+        write_finger(fd, device_flags, positions[i].x, positions[i].y,
+                     frame == FRAME_PRESS);
+    }
+    // the single finger commands leave the slot alone and expect slot 0
+    if (frame == FRAME_RELEASE && mt_slot != 0)
+      change_mt_slot(fd, device_flags, 0);
+  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
+    if (frame != FRAME_RELEASE) {
+      write_event(fd, EV_ABS, ABS_X, positions[0].x);
+      write_event(fd, EV_ABS, ABS_Y, positions[0].y);
+    }
+  }
+  // a finger held down by a press command keeps BTN_TOUCH down
+  if (frame == FRAME_PRESS || (frame == FRAME_RELEASE && !others))
+    write_event(fd, EV_KEY, BTN_TOUCH, frame == FRAME_PRESS);
+  write_event(fd, EV_SYN, SYN_REPORT, 0);
+}
+
+/* Press every finger where it starts, move them all along their paths one
+   frame per deadline, release them together and wait a little. */
+void execute_touches(int fd, uint32_t device_flags, struct finger *fingers,
+                     int num_fingers, int num_steps, int duration_msec)
+{
+  struct point positions[MAX_FINGERS];
+  int64_t start_nsec, release_nsec, move_pacing_nsec;
+  int i, j;
+
+  if (!(device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) && num_fingers > 1)
+    num_fingers = 1;
+  for (i=0; i<num_fingers; i++) {
+    fingers[i].slot = alloc_mt_slot();
+    if (fingers[i].slot < 0) {
+      fprintf(stderr, "out of touch slots, only using %d of %d fingers\n",
+              i, num_fingers);
+      num_fingers = i;
+    }
+  }
+  if (!num_fingers)
+    return;
+
+  // wake up early by what the pacing policy adds to a whole frame
+  move_pacing_nsec = pacing_nsec(num_fingers *
+    (frame_size(device_flags, FRAME_MOVE) - 1 +
+     !(device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)) + 1);
+
+  // press
+  for (i=0; i<num_fingers; i++) {
+    positions[i].x = fingers[i].x;
+    positions[i].y = fingers[i].y;
+  }
+  start_nsec = now_nsec();
+  write_touches(fd, device_flags, fingers, positions, num_fingers,
+                FRAME_PRESS);
+
+  // move, all fingers in one frame per deadline
+  for (j=0; j<num_steps; j++) {
+    execute_sleep_until(start_nsec + (int64_t)(j+1) * duration_msec *
+                        NSEC_PER_MSEC / num_steps - move_pacing_nsec);
+    for (i=0; i<num_fingers; i++)
+      positions[i] = fingers[i].path[j];
+    write_touches(fd, device_flags, fingers, positions, num_fingers,
+                  FRAME_MOVE);
+  }
+
+  // release
+  write_touches(fd, device_flags, fingers, positions, num_fingers,
+                FRAME_RELEASE);
+  release_nsec = now_nsec();
+  for (i=0; i<num_fingers; i++)
+    free_mt_slot(fingers[i].slot);
+
+  // wait
+  execute_sleep_until(release_nsec + 100 * NSEC_PER_MSEC);
+}
+
+/* The *_fingers() functions set up where each finger of a gesture goes
+   down and the path it follows, in paths, num_steps points per finger. */
+void pinch_fingers(struct finger *fingers, struct point *paths,
+                   int touch1_x1, int touch1_y1, int touch1_x2,
+                   int touch1_y2, int touch2_x1, int touch2_y1,
+                   int touch2_x2, int touch2_y2, int num_steps)
+{
+  line_path(paths, touch1_x1, touch1_y1, touch1_x2, touch1_y2, num_steps);
+  line_path(paths + num_steps, touch2_x1, touch2_y1, touch2_x2, touch2_y2,
+            num_steps);
+  fingers[0].x = touch1_x1;
+  fingers[0].y = touch1_y1;
+  fingers[0].path = paths;
+  fingers[1].x = touch2_x1;
+  fingers[1].y = touch2_y1;
+  fingers[1].path = paths + num_steps;
+}
+
+void execute_pinch(int fd, uint32_t device_flags, int touch1_x1,
+                   int touch1_y1, int touch1_x2, int touch1_y2, int touch2_x1,
+                   int touch2_y1, int touch2_x2, int touch2_y2, int num_steps,
+                   int duration_msec)
+{
+  struct point *paths = alloc_path(2 * num_steps);
+  struct finger fingers[2];
+
+  print_action(ACTION_START, TRACE_PINCH,
+               touch1_x1, touch1_y1, touch1_x2, touch1_y2,
+               touch2_x1, touch2_y1, touch2_x2, touch2_y2,
+               num_steps, duration_msec);
+
+  pinch_fingers(fingers, paths, touch1_x1, touch1_y1, touch1_x2, touch1_y2,
+                touch2_x1, touch2_y1, touch2_x2, touch2_y2, num_steps);
+  execute_touches(fd, device_flags, fingers, 2, num_steps, duration_msec);
+
+  print_action(ACTION_END, TRACE_PINCH);
+  free(paths);
+}
+
+/* num_fingers fingers spread evenly on a circle around a center, turning
+   by degrees. */
+void rotate_fingers(struct finger *fingers, struct point *paths,
+                    int center_x, int center_y, int radius, int degrees,
+                    int num_fingers, int num_steps)
+{
+  double angle, turn = degrees * M_PI / 180;
+  int i, j;
+
+  for (i=0; i<num_fingers; i++) {
+    angle = 2 * M_PI * i / num_fingers;
+    fingers[i].x = center_x + (int)lround(radius * cos(angle));
+    fingers[i].y = center_y + (int)lround(radius * sin(angle));
+    fingers[i].path = paths + i * num_steps;
+    for (j=0; j<num_steps; j++) {
+      angle = 2 * M_PI * i / num_fingers + turn * (j+1) / num_steps;
+      paths[i * num_steps + j].x = center_x + (int)lround(radius * cos(angle));
+      paths[i * num_steps + j].y = center_y + (int)lround(radius * sin(angle));
+    }
+  }
+}
+
+void execute_rotate(int fd, uint32_t device_flags, int center_x,
+                    int center_y, int radius, int degrees, int num_fingers,
+                    int num_steps, int duration_msec)
+{
+  struct point *paths = alloc_path(num_fingers * num_steps);
+  struct finger fingers[MAX_FINGERS];
+
+  print_action(ACTION_START, TRACE_ROTATE, center_x, center_y, radius,
+               degrees, num_fingers, num_steps, duration_msec);
+
+  rotate_fingers(fingers, paths, center_x, center_y, radius, degrees,
+                 num_fingers, num_steps);
+  execute_touches(fd, device_flags, fingers, num_fingers, num_steps,
+                  duration_msec);
+
+  print_action(ACTION_END, TRACE_ROTATE);
+  free(paths);
+}
+
+/* num_fingers fingers side by side, spacing apart across the direction of
+   the swipe, centered on the line from start to end. */
+void swipe_fingers(struct finger *fingers, struct point *paths, int start_x,
+                   int start_y, int end_x, int end_y, int num_fingers,
+                   int spacing, int num_steps)
+{
+  double length = hypot(end_x - start_x, end_y - start_y);
+  double normal_x = 1, normal_y = 0, offset;
+  int dx, dy, i;
+
+  if (length > 0) {
+    normal_x = (start_y - end_y) / length;
+    normal_y = (end_x - start_x) / length;
+  }
+  for (i=0; i<num_fingers; i++) {
+    offset = (i - (num_fingers - 1) / 2.0) * spacing;
+    dx = (int)lround(normal_x * offset);
+    dy = (int)lround(normal_y * offset);
+    fingers[i].x = start_x + dx;
+    fingers[i].y = start_y + dy;
+    fingers[i].path = paths + i * num_steps;
+    line_path(paths + i * num_steps, start_x + dx, start_y + dy, end_x + dx,
+              end_y + dy, num_steps);
+  }
+}
+
+void execute_swipe(int fd, uint32_t device_flags, int start_x, int start_y,
+                   int end_x, int end_y, int num_fingers, int spacing,
+                   int num_steps, int duration_msec)
+{
+  struct point *paths = alloc_path(num_fingers * num_steps);
+  struct finger fingers[MAX_FINGERS];
+
+  print_action(ACTION_START, TRACE_SWIPE, start_x, start_y, end_x, end_y,
+               num_fingers, spacing, num_steps, duration_msec);
+
+  swipe_fingers(fingers, paths, start_x, start_y, end_x, end_y, num_fingers,
+                spacing, num_steps);
+  execute_touches(fd, device_flags, fingers, num_fingers, num_steps,
+                  duration_msec);
+
+  print_action(ACTION_END, TRACE_SWIPE);
+  free(paths);
+}
+
+/* num_fingers fingers on a circle around a center that turns once while it
+   shrinks to half its radius and grows back, so that every finger moves in
+   every frame. */
+void stress_fingers(struct finger *fingers, struct point *paths,
+                    int center_x, int center_y, int radius, int num_fingers,
+                    int num_steps)
+{
+  double angle, r, t;
+  int i, j;
+
+  for (i=0; i<num_fingers; i++) {
+    angle = 2 * M_PI * i / num_fingers;
+    fingers[i].x = center_x + (int)lround(radius * cos(angle));
+    fingers[i].y = center_y + (int)lround(radius * sin(angle));
+    fingers[i].path = paths + i * num_steps;
+    for (j=0; j<num_steps; j++) {
+      t = (double)(j+1) / num_steps;
+      angle = 2 * M_PI * ((double)i / num_fingers + t);
+      r = radius * (1 - 0.5 * sin(M_PI * t));
+      paths[i * num_steps + j].x = center_x + (int)lround(r * cos(angle));
+      paths[i * num_steps + j].y = center_y + (int)lround(r * sin(angle));
+    }
+  }
+}
+
+void execute_stress(int fd, uint32_t device_flags, int center_x,
+                    int center_y, int radius, int num_fingers, int num_steps,
+                    int duration_msec)
+{
+  struct point *paths = alloc_path(num_fingers * num_steps);
+  struct finger fingers[MAX_FINGERS];
+
+  print_action(ACTION_START, TRACE_STRESS, center_x, center_y, radius,
+               num_fingers, num_steps, duration_msec);
+
+  stress_fingers(fingers, paths, center_x, center_y, radius, num_fingers,
+                 num_steps);
+  execute_touches(fd, device_flags, fingers, num_fingers, num_steps,
+                  duration_msec);
+
+  print_action(ACTION_END, TRACE_STRESS);
+  free(paths);
+}
+
+/* Move the finger from where it is to x, y in num_steps even steps, one
+   frame per step. Unlike a drag, the finger stays down. */
+void execute_move_to(int fd, uint32_t device_flags, int x, int y,
+                     int num_steps, int duration_msec)
+{
+  struct point *path = alloc_path(num_steps);
+
+  line_path(path, touch_x, touch_y, x, y, num_steps);
+  execute_path(fd, device_flags, path, num_steps, now_nsec(), duration_msec);
+  touch_x = x;
+  touch_y = y;
+  free(path);
+}
+
+void execute_keyup(int fd, int key) {
+  write_event(fd, EV_KEY, key, 0);
+  write_event(fd, EV_SYN, SYN_REPORT, 0);
+}
+
+void execute_keydown(int fd, int key) {
+  write_event(fd, EV_KEY, key, 1);
+  write_event(fd, EV_SYN, SYN_REPORT, 0);
+}
+
+void execute_reset(int fd, uint32_t device_flags) {
+  print_action(ACTION_START, TRACE_RESET);
+  if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) {
+    write_event(fd, EV_ABS, ABS_MT_POSITION_X, 0);
+    write_event(fd, EV_ABS, ABS_MT_POSITION_Y, 0);
+    write_event(fd, EV_ABS, ABS_MT_PRESSURE, 0);
+    write_event(fd, EV_ABS, ABS_MT_TOUCH_MAJOR, 0);
+    write_event(fd, EV_ABS, ABS_MT_WIDTH_MAJOR, 0);
+  } else if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
+    write_event(fd, EV_ABS, ABS_X, 0);
+    write_event(fd, EV_ABS, ABS_Y, 0);
+  }
+  write_event(fd, EV_SYN, SYN_REPORT, 0);
+  print_action(ACTION_END, TRACE_RESET);
+}
+
+/* Work out how to talk to a device from the keys and axes it has. */
+uint32_t device_class_of(const uint8_t *key_bitmask, const uint8_t *abs_bitmask,
+                         const char *device_name) {
+
+  uint32_t device_classes = 0;
+
+  // See if this is a touch pad.
   // Is this a new modern multi-touch driver?
   if (test_bit(ABS_MT_POSITION_X, abs_bitmask)
       && test_bit(ABS_MT_POSITION_Y, abs_bitmask)) {
@@ -391,104 +2129,3028 @@ uint32_t figure_out_events_device_reports(int fd) {
     // Mozilla Bug 741038 - support GB touchscreen drivers
     //if (test_bit(BTN_TOUCH, device->keyBitmask) || !haveGamepadButtons) {
     device_classes |= INPUT_DEVICE_CLASS_TOUCH | INPUT_DEVICE_CLASS_TOUCH_MT;
-    char device_name[80];
 
-    if(ioctl(fd, EVIOCGNAME(sizeof(device_name) - 1), &device_name) < 1) {
-      //fprintf(stderr, "could not get device name for %s, %s\n", device, strerror(errno));
-      device_name[0] = '\0';
-    }
+    // some touchscreen devices expect MT_SYN events to be sent after every
+    // touch
+    if(strcmp(device_name, "atmel-touchscreen") == 0 ||
+       strcmp(device_name, "nvodm_touch") == 0 ||
+       strcmp(device_name, "elan-touchscreen") == 0 ||
+       strcmp(device_name, "ft5x06_ts") == 0) {
+      device_classes |= INPUT_DEVICE_CLASS_TOUCH_MT_SYNC;
+    }
+
+  // Is this an old style single-touch driver?
+  } else if ((test_bit(BTN_TOUCH, key_bitmask)
+              && test_bit(ABS_X, abs_bitmask)
+              && test_bit(ABS_Y, abs_bitmask))) {
+    device_classes |= INPUT_DEVICE_CLASS_TOUCH;
+  }
+
+  return device_classes;
+}
+
+uint32_t figure_out_events_device_reports(int fd) {
+
+  uint8_t key_bitmask[(KEY_MAX + 1) / 8 + !!((KEY_MAX + 1) % 8)];
+  uint8_t abs_bitmask[(ABS_MAX + 1) / 8 + !!((ABS_MAX + 1) % 8)];
+  char device_name[80];
+  struct input_absinfo slot_info;
+  uint32_t flags;
+
+  memset(key_bitmask, 0, sizeof(key_bitmask));
+  memset(abs_bitmask, 0, sizeof(abs_bitmask));
+
+  ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bitmask)), key_bitmask);
+  ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_bitmask)), abs_bitmask);
+
+  memset(device_name, 0, sizeof(device_name));
+  if(ioctl(fd, EVIOCGNAME(sizeof(device_name) - 1), &device_name) < 1) {
+    //fprintf(stderr, "could not get device name for %s, %s\n", device, strerror(errno));
+    device_name[0] = '\0';
+  }
+
+  flags = device_class_of(key_bitmask, abs_bitmask, device_name);
+  if ((flags & INPUT_DEVICE_CLASS_TOUCH_MT) &&
+      !(flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC) &&
+      test_bit(ABS_MT_SLOT, abs_bitmask) &&
+      ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &slot_info) == 0)
+    set_mt_slots(slot_info.maximum);
+  return flags;
+}
+
+/* Devices from kernel/devspec.h can be created through uinput, which needs
+   no kernel module. The table is the one the module is built from; add
+   mkdevinfo's output to it to emulate another device. */
+static const struct orng_device_info device_specs[] = {
+#include "kernel/devspec.h"
+};
+
+#define UINPUT_WAIT_MSEC 1000
+
+/* Set every bit of bits with the uinput request. */
+int set_uinput_bits(int fd, unsigned long request, const uint8_t *bits,
+                    int num_bits)
+{
+  int i;
+
+  for (i=0; i<num_bits; i++) {
+    if (test_bit(i, bits) && ioctl(fd, request, i) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* Find the event device the kernel created for a uinput device. */
+int find_uinput_event_device(int fd, char *path, size_t len)
+{
+  char sysname[64], dirname[128];
+  struct dirent *entry;
+  DIR *dir;
+  int found = 0;
+
+  memset(sysname, 0, sizeof(sysname));
+  if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname) - 1), sysname) < 0)
+    return -1;
+
+  snprintf(dirname, sizeof(dirname), "/sys/devices/virtual/input/%s",
+           sysname);
+  dir = opendir(dirname);
+  if (!dir)
+    return -1;
+  while (!found && (entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "event", 5) == 0) {
+      snprintf(path, len, "/dev/input/%s", entry->d_name);
+      found = 1;
+    }
+  }
+  closedir(dir);
+  return found ? 0 : -1;
+}
+
+/* Create the device named cname in kernel/devspec.h. Events written to the
+   returned fd go to the new device, which goes away when the fd is closed.
+   The path of its event device is put in event_path, if it can be found. */
+int create_uinput_device(const char *cname, uint32_t *device_flags,
+                         char *event_path, size_t len)
+{
+  const struct orng_device_info *spec = NULL;
+  struct uinput_user_dev dev;
+  int fd, i;
+  size_t k;
+
+  for (k=0; k<sizeof(device_specs)/sizeof(device_specs[0]); k++) {
+    if (strcmp(device_specs[k].cname, cname) == 0)
+      spec = &device_specs[k];
+  }
+  if (!spec) {
+    fprintf(stderr, "Unknown device: %s, known devices are:\n", cname);
+    for (k=0; k<sizeof(device_specs)/sizeof(device_specs[0]); k++)
+      fprintf(stderr, "  %s\n", device_specs[k].cname);
+    return -1;
+  }
+
+  fd = open("/dev/uinput", O_RDWR);
+  if (fd < 0) {
+    fprintf(stderr, "could not open /dev/uinput, %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (set_uinput_bits(fd, UI_SET_EVBIT, spec->evbit, EV_MAX + 1) < 0 ||
+      set_uinput_bits(fd, UI_SET_KEYBIT, spec->keybit, KEY_MAX + 1) < 0 ||
+      set_uinput_bits(fd, UI_SET_RELBIT, spec->relbit, REL_MAX + 1) < 0 ||
+      set_uinput_bits(fd, UI_SET_ABSBIT, spec->absbit, ABS_MAX + 1) < 0 ||
+      set_uinput_bits(fd, UI_SET_MSCBIT, spec->mscbit, MSC_MAX + 1) < 0 ||
+      set_uinput_bits(fd, UI_SET_LEDBIT, spec->ledbit, LED_MAX + 1) < 0 ||
+      set_uinput_bits(fd, UI_SET_SNDBIT, spec->sndbit, SND_MAX + 1) < 0 ||
+      set_uinput_bits(fd, UI_SET_FFBIT, spec->ffbit, FF_MAX + 1) < 0 ||
+      set_uinput_bits(fd, UI_SET_SWBIT, spec->swbit, SW_MAX + 1) < 0) {
+    fprintf(stderr, "could not set up %s, %s\n", cname, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  *device_flags = device_class_of(spec->keybit, spec->absbit, spec->name);
+  if (test_bit(ABS_MT_SLOT, spec->absbit))
+    set_mt_slots(spec->absinfo[ABS_MT_SLOT].maximum);
+
+  // the table predates input properties, but without this a touchscreen
+  // would be taken for a touchpad; older kernels don't know about them
+  if (*device_flags & INPUT_DEVICE_CLASS_TOUCH)
+    ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT);
+
+  memset(&dev, 0, sizeof(dev));
+  strncpy(dev.name, spec->name, sizeof(dev.name) - 1);
+  dev.id = spec->id;
+  for (i=0; i<=ABS_MAX; i++) {
+    dev.absmin[i] = spec->absinfo[i].minimum;
+    dev.absmax[i] = spec->absinfo[i].maximum;
+    dev.absfuzz[i] = spec->absinfo[i].fuzz;
+    dev.absflat[i] = spec->absinfo[i].flat;
+  }
+
+  if (write_fully(fd, &dev, sizeof(dev)) < 0 ||
+      ioctl(fd, UI_DEV_CREATE) < 0) {
+    fprintf(stderr, "could not create %s, %s\n", cname, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  // udev or ueventd creates the device node a little after the device
+  event_path[0] = '\0';
+  if (find_uinput_event_device(fd, event_path, len) == 0) {
+    for (i=0; i<UINPUT_WAIT_MSEC / 10 && access(event_path, R_OK) < 0; i++)
+      usleep(10 * 1000);
+  }
+  return fd;
+}
+
+/* Script reader. Regular files are mmap()ed and tokenized in place; other
+   inputs are read into a buffer that grows until it holds a whole line, so
+   lines can be any length. Tokens are slices of the buffer and are never
+   copied, which means a command is only valid until the next one is read. */
+#define SCRIPT_CHUNK_SIZE (64 * 1024)
+
+struct script_reader {
+  int fd;              /* where to read more from, -1 once everything is in buf */
+  char *buf;
+  size_t len;          /* bytes in buf */
+  size_t capacity;
+  size_t pos;          /* start of the next line */
+  size_t bytes_read;
+  int mapped;
+  int line;
+  const char *cur;     /* unread part of the current line */
+  const char *line_end;
+  /* called for each block comment, in script order */
+  void (*on_comment)(void *ctx, const char *text, size_t len, int line);
+  void *ctx;
+  int single_line;     /* stop at the end of the current line, or of the
+                          block open on it */
+  int expect_block;    /* a '{' opens a block instead of a comment */
+  int block_depth;
+  int finger_down;     /* after a press, for checking move and release across
+                          the lines of a stream */
+};
+
+struct script_command {
+  const char *name;
+  size_t name_len;
+  int args[MAX_COMMAND_ARGS];
+  int num_args;
+  uint64_t word_args;  /* bitmask of args given as keywords */
+  int block;           /* followed by a '{' that opens a block */
+  int line;
+};
+
+/* Words scripts can give in place of some numbers. */
+struct script_keyword {
+  const char *name;
+  int value;
+};
+
+static const struct script_keyword script_keywords[] = {
+  { "linear", PROFILE_LINEAR },
+  { "ease", PROFILE_EASE },
+  { "fling", PROFILE_FLING },
+  { "stop", PROFILE_STOP }
+};
+
+enum {
+  TOKEN_ERROR = -1,
+  TOKEN_END_OF_LINE = 0,
+  TOKEN_WORD,
+  TOKEN_SEPARATOR,
+  TOKEN_COMMENT,
+  TOKEN_BLOCK_START,
+  TOKEN_BLOCK_END
+};
+
+void script_init_fd(struct script_reader *r, int fd)
+{
+  memset(r, 0, sizeof(*r));
+  r->fd = fd;
+}
+
+int script_open(struct script_reader *r, const char *path)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    fprintf(stderr, "Unable to read file %s, %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  script_init_fd(r, fd);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      r->buf = (char *)map;
+      r->len = r->capacity = r->bytes_read = st.st_size;
+      r->mapped = 1;
+      close(fd);
+      r->fd = -1;
+    }
+  }
+  return 0;
+}
+
+void script_close(struct script_reader *r)
+{
+  if (r->mapped)
+    munmap(r->buf, r->capacity);
+  else
+    free(r->buf);
+  if (r->fd >= 0)
+    close(r->fd);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+/* Make the next line current. Returns 0 at the end of the script. */
+int script_next_line(struct script_reader *r)
+{
+  const char *nl;
+  const char *comment;
+  ssize_t ret;
+
+  for (;;) {
+    // a stream starts out without a buffer, there's nothing to search yet
+    nl = NULL;
+    if (r->pos < r->len)
+      nl = (const char *)memchr(r->buf + r->pos, '\n', r->len - r->pos);
+    if (nl || r->fd < 0)
+      break;
+
+    // no complete line yet, drop what we've consumed and read more
+    if (r->pos) {
+      memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+      r->len -= r->pos;
+      r->pos = 0;
+    }
+    if (r->len == r->capacity) {
+      r->capacity = r->capacity ? r->capacity * 2 : SCRIPT_CHUNK_SIZE;
+      r->buf = (char *)realloc(r->buf, r->capacity);
+      assert(r->buf);
+    }
+    do {
+      ret = read(r->fd, r->buf + r->len, r->capacity - r->len);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+      if (ret < 0)
+        fprintf(stderr, "could not read script, %s\n", strerror(errno));
+      close(r->fd);
+      r->fd = -1;
+    } else {
+      r->len += ret;
+      r->bytes_read += ret;
+    }
+  }
+
+  if (r->pos == r->len)
+    return 0;
+
+  r->line++;
+  r->cur = r->buf + r->pos;
+  r->line_end = nl ? nl : r->buf + r->len;
+  r->pos = (r->line_end - r->buf) + (nl ? 1 : 0);
+
+  // remove end-of-line comments
+  comment = (const char *)memchr(r->cur, '#', r->line_end - r->cur);
+  if (comment)
+    r->line_end = comment;
+  return 1;
+}
+
+int is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* Next token on the current line. Comments are returned without their
+   braces. Right after a command that takes a block, '{' opens the block, and
+   inside a block a '}' outside of comments closes it. */
+int script_next_token(struct script_reader *r, const char **start,
+                      size_t *len)
+{
+  const char *p = r->cur, *end = r->line_end;
+  const char *close;
+  int expect_block = r->expect_block;
+
+  r->expect_block = 0;
+  while (p < end && is_blank(*p))
+    p++;
+  if (p == end) {
+    r->cur = p;
+    return TOKEN_END_OF_LINE;
+  }
+
+  if (*p == ';') {
+    r->cur = p + 1;
+    return TOKEN_SEPARATOR;
+  }
+
+  if (*p == '{' && expect_block) {
+    r->cur = p + 1;
+    return TOKEN_BLOCK_START;
+  }
+
+  if (*p == '}' && r->block_depth) {
+    r->cur = p + 1;
+    return TOKEN_BLOCK_END;
+  }
+
+  if (*p == '{') {
+    close = (const char *)memchr(p, '}', end - p);
+    if (!close) {
+      printf("Missing '}' to end a comment block at line %d.\n", r->line);
+      return TOKEN_ERROR;
+    }
+    r->cur = close + 1;
+    for (p++; p < close && is_blank(*p); p++)
+      ;
+    while (close > p && is_blank(close[-1]))
+      close--;
+    *start = p;
+    *len = close - p;
+    return TOKEN_COMMENT;
+  }
+
+  *start = p;
+  while (p < end && !is_blank(*p) && *p != ';' && *p != '{' &&
+         (*p != '}' || !r->block_depth))
+    p++;
+  *len = p - *start;
+  r->cur = p;
+  return TOKEN_WORD;
+}
+
+/* Parse a decimal integer that makes up the whole token. */
+int parse_int(const char *start, size_t len, int *value)
+{
+  const char *p = start, *end = start + len;
+  int negative = 0;
+  int64_t n = 0;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = (*p++ == '-');
+  if (p == end)
+    return -1;
+
+  for (; p < end; p++) {
+    if (*p < '0' || *p > '9')
+      return -1;
+    n = n * 10 + (*p - '0');
+    if (n > (int64_t)INT32_MAX + negative)
+      return -1;
+  }
+
+  *value = (int)(negative ? -n : n);
+  return 0;
+}
+
+int parse_keyword(const char *start, size_t len, int *value)
+{
+  size_t i;
+
+  for (i=0; i<sizeof(script_keywords)/sizeof(script_keywords[0]); i++) {
+    // tokens may hold a NUL, so compare lengths rather than stop at one
+    if (strlen(script_keywords[i].name) == len &&
+        memcmp(start, script_keywords[i].name, len) == 0) {
+      *value = script_keywords[i].value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Read the next command. Block comments are handed to r->on_comment as they
+   are passed. A command that opens a block comes back with cmd->block set,
+   and the end of the block as a command named "}". Returns 1 for a command,
+   0 at the end of the script and -1 on errors, after which the rest of the
+   line is skipped and reading can go on. */
+int script_next_command(struct script_reader *r, struct script_command *cmd)
+{
+  const char *start, *before;
+  size_t len;
+  int token;
+
+  cmd->name = NULL;
+  cmd->num_args = 0;
+  cmd->word_args = 0;
+  cmd->block = 0;
+
+  for (;;) {
+    before = r->cur;
+    if (!r->cur || (token = script_next_token(r, &start, &len)) ==
+        TOKEN_END_OF_LINE) {
+      if (cmd->name)
+        return 1;
+      // a block that is still open goes on over the next lines
+      if ((r->single_line && !r->block_depth) || !script_next_line(r))
+        return 0;
+      continue;
+    }
+
+    if (token == TOKEN_ERROR) {
+      r->cur = r->line_end;
+      return -1;
+    }
+
+    if (token == TOKEN_COMMENT) {
+      if (r->on_comment)
+        r->on_comment(r->ctx, start, len, r->line);
+      continue;
+    }
+
+    if (token == TOKEN_SEPARATOR) {
+      if (cmd->name)
+        return 1;
+      continue;
+    }
+
+    if (token == TOKEN_BLOCK_START) {
+      cmd->block = 1;
+      r->block_depth++;
+      return 1;
+    }
+
+    if (token == TOKEN_BLOCK_END) {
+      // finish the command before the '}' first
+      if (cmd->name) {
+        r->cur = before;
+        return 1;
+      }
+      cmd->name = "}";
+      cmd->name_len = 1;
+      cmd->line = r->line;
+      r->block_depth--;
+      return 1;
+    }
+
+    if (!cmd->name) {
+      cmd->name = start;
+      cmd->name_len = len;
+      cmd->line = r->line;
+      r->expect_block = len == 8 && memcmp(start, "parallel", len) == 0;
+    } else if (cmd->num_args == MAX_COMMAND_ARGS) {
+      printf("At line %d, too many arguments to '%.*s'.\n", r->line,
+             (int)cmd->name_len, cmd->name);
+      r->cur = r->line_end;
+      return -1;
+    } else if (parse_int(start, len, &cmd->args[cmd->num_args]) == 0) {
+      cmd->num_args++;
+    } else if (parse_keyword(start, len, &cmd->args[cmd->num_args]) == 0) {
+      cmd->word_args |= 1ull << cmd->num_args;
+      cmd->num_args++;
+    } else {
+      printf("At line %d, '%.*s' is not a number.\n", r->line, (int)len,
+             start);
+      r->cur = r->line_end;
+      return -1;
+    }
+  }
+}
+
+/* Scripts are checked and turned into a program before anything is sent, so
+   a mistake halfway through can't leave a finger down on the device, and
+   executing a command doesn't involve any parsing. */
+enum {
+  CMD_COMMENT = 0,
+  CMD_TAP,
+  CMD_DRAG,
+  CMD_SLEEP,
+  CMD_PINCH,
+  CMD_KEYUP,
+  CMD_KEYDOWN,
+  CMD_RESET,
+  CMD_PRESS,
+  CMD_MOVE,
+  CMD_RELEASE,
+  CMD_CURVE,
+  CMD_SPLINE,
+  CMD_ROTATE,
+  CMD_SWIPE,
+  CMD_STRESS,
+  CMD_PARALLEL
+};
+
+struct command_spec {
+  const char *name;
+  int opcode;
+  int min_args;
+  int max_args;
+  uint64_t word_args; /* bitmask of args that must be keywords */
+};
+
+static const struct command_spec command_specs[] = {
+  { "tap", CMD_TAP, 4, 4 },
+  { "drag", CMD_DRAG, 6, 8, 1ull << 6 },
+  { "sleep", CMD_SLEEP, 1, 1 },
+  { "pinch", CMD_PINCH, 10, 10 },
+  { "keyup", CMD_KEYUP, 1, 1 },
+  { "keydown", CMD_KEYDOWN, 1, 1 },
+  { "reset", CMD_RESET, 0, 0 },
+  { "press", CMD_PRESS, 2, 2 },
+  { "move", CMD_MOVE, 4, 4 },
+  { "release", CMD_RELEASE, 0, 0 },
+  { "curve", CMD_CURVE, 8, 10 },
+  { "spline", CMD_SPLINE, 6, MAX_COMMAND_ARGS },
+  { "rotate", CMD_ROTATE, 7, 7 },
+  { "swipe", CMD_SWIPE, 8, 8 },
+  { "stress", CMD_STRESS, 6, 6 },
+  { "parallel", CMD_PARALLEL, 0, 0 }
+};
+
+/* Parallel blocks run each of their lines as a lane of its own. Every lane
+   is planned ahead, so they can only hold commands whose timing is known
+   before they run. */
+#define MAX_LANES 16
+
+int runs_in_parallel(int opcode)
+{
+  switch (opcode) {
+  case CMD_TAP:
+  case CMD_DRAG:
+  case CMD_SLEEP:
+  case CMD_PINCH:
+  case CMD_KEYUP:
+  case CMD_KEYDOWN:
+  case CMD_CURVE:
+  case CMD_SPLINE:
+  case CMD_ROTATE:
+  case CMD_SWIPE:
+  case CMD_STRESS:
+    return 1;
+  }
+  return 0;
+}
+
+struct command {
+  int opcode;
+  int line;
+  uint32_t first_arg; /* into program.args, or program.text for comments */
+  uint32_t num_args;  /* or the length of the comment, or the number of
+                         commands in a parallel block */
+};
+
+struct program {
+  struct command *commands;
+  size_t num_commands;
+  size_t commands_capacity;
+  int *args;
+  size_t num_args;
+  size_t args_capacity;
+  char *text;
+  size_t text_len;
+  size_t text_capacity;
+};
+
+void *grow_array(void *array, size_t *capacity, size_t needed, size_t size)
+{
+  if (needed <= *capacity)
+    return array;
+  while (*capacity < needed)
+    *capacity = *capacity ? *capacity * 2 : 256;
+  array = realloc(array, *capacity * size);
+  assert(array);
+  return array;
+}
+
+struct command *program_add(struct program *p, int opcode, int line)
+{
+  struct command *command;
+
+  p->commands = (struct command *)grow_array(p->commands,
+                                             &p->commands_capacity,
+                                             p->num_commands + 1,
+                                             sizeof(struct command));
+  command = &p->commands[p->num_commands++];
+  command->opcode = opcode;
+  command->line = line;
+  command->first_arg = 0;
+  command->num_args = 0;
+  return command;
+}
+
+/* Comments are copied, the script buffer may not outlive the program */
+void program_add_comment(void *ctx, const char *text, size_t len, int line)
+{
+  struct program *p = (struct program *)ctx;
+  struct command *command = program_add(p, CMD_COMMENT, line);
+
+  p->text = (char *)grow_array(p->text, &p->text_capacity, p->text_len + len,
+                               1);
+  memcpy(p->text + p->text_len, text, len);
+  command->first_arg = p->text_len;
+  command->num_args = len;
+  p->text_len += len;
+}
+
+void program_free(struct program *p)
+{
+  free(p->commands);
+  free(p->args);
+  free(p->text);
+  memset(p, 0, sizeof(*p));
+}
+
+const char *command_name(int opcode)
+{
+  size_t i;
+
+  for (i=0; i<sizeof(command_specs)/sizeof(command_specs[0]); i++) {
+    if (command_specs[i].opcode == opcode)
+      return command_specs[i].name;
+  }
+  return "comment";
+}
+
+/* Gesture paths are worked out up front, a point per finger per step, so
+   the number of steps is capped to keep them a sensible size. */
+#define MAX_STEPS 100000
+
+int validate_steps(const struct script_command *cmd, const char *name,
+                   int num_steps, int duration_msec)
+{
+  if (num_steps > 0 && num_steps <= MAX_STEPS && duration_msec >= 0)
+    return 0;
+  printf("At line %d, %s needs from 1 to %d steps and a non-negative "
+         "duration.\n", cmd->line, name, MAX_STEPS);
+  return 1;
+}
+
+/* Returns the number of problems found with the arguments of a command. */
+int validate_command(const struct script_command *cmd, int opcode)
+{
+  const int *args = cmd->args;
+  int errors = 0;
+  int n;
+
+  switch (opcode) {
+  case CMD_TAP:
+    if (args[2] < 0 || args[3] < 0) {
+      printf("At line %d, tap needs a non-negative count and duration.\n",
+             cmd->line);
+      errors++;
+    }
+    break;
+  case CMD_DRAG:
+    errors += validate_steps(cmd, "drag", args[4], args[5]);
+    if (cmd->num_args == 7 && args[6] == PROFILE_FLING) {
+      printf("At line %d, fling needs a lift-off speed.\n", cmd->line);
+      errors++;
+    } else if (cmd->num_args == 8 && args[6] != PROFILE_FLING &&
+               args[6] != PROFILE_STOP) {
+      printf("At line %d, only fling and stop take an argument.\n",
+             cmd->line);
+      errors++;
+    } else if (cmd->num_args == 8 && args[7] < 0) {
+      printf("At line %d, %s needs a non-negative %s.\n", cmd->line,
+             args[6] == PROFILE_FLING ? "fling" : "stop",
+             args[6] == PROFILE_FLING ? "speed" : "duration");
+      errors++;
+    }
+    break;
+  case CMD_MOVE:
+    errors += validate_steps(cmd, "move", args[2], args[3]);
+    break;
+  case CMD_PINCH:
+    errors += validate_steps(cmd, "pinch", args[8], args[9]);
+    break;
+  case CMD_CURVE:
+  case CMD_SPLINE:
+    if (cmd->num_args % 2) {
+      printf("At line %d, %s needs an x and a y for every point.\n",
+             cmd->line, opcode == CMD_CURVE ? "curve" : "spline");
+      errors++;
+    } else {
+      errors += validate_steps(cmd, command_name(opcode),
+                               args[cmd->num_args-2], args[cmd->num_args-1]);
+    }
+    break;
+  case CMD_ROTATE:
+  case CMD_SWIPE:
+  case CMD_STRESS:
+    errors += validate_steps(cmd, command_name(opcode),
+                             args[cmd->num_args-2], args[cmd->num_args-1]);
+    // the finger count comes right before the steps, or before the spacing
+    n = args[cmd->num_args - (opcode == CMD_SWIPE ? 4 : 3)];
+    if (n < 1 || n > MAX_FINGERS) {
+      printf("At line %d, %s needs from 1 to %d fingers.\n", cmd->line,
+             command_name(opcode), MAX_FINGERS);
+      errors++;
+    }
+    if (opcode != CMD_SWIPE && args[2] < 0) {
+      printf("At line %d, %s needs a non-negative radius.\n", cmd->line,
+             command_name(opcode));
+      errors++;
+    }
+    if (opcode == CMD_SWIPE && args[5] < 0) {
+      printf("At line %d, swipe needs a non-negative spacing.\n",
+             cmd->line);
+      errors++;
+    }
+    break;
+  case CMD_SLEEP:
+    if (args[0] < 0) {
+      printf("At line %d, sleep needs a non-negative duration.\n",
+             cmd->line);
+      errors++;
+    }
+    break;
+  case CMD_KEYUP:
+  case CMD_KEYDOWN:
+    if (args[0] < 0 || args[0] > KEY_MAX) {
+      printf("At line %d, %d is not a key code.\n", cmd->line, args[0]);
+      errors++;
+    }
+    break;
+  }
+  return errors;
+}
+
+/* Parse a whole script into p, reporting every error found along the way.
+   Returns the number of errors. */
+int compile_program(struct script_reader *r, struct program *p)
+{
+  struct script_command cmd;
+  const struct command_spec *spec;
+  struct command *command;
+  size_t block = 0;   /* the open parallel block, as its index + 1 */
+  int block_depth = 0, block_line = 0;
+  int finger_down = r->finger_down;
+  int num_lanes = 0, lane_line = 0;
+  int errors = 0;
+  int ret;
+  size_t i;
+
+  r->on_comment = program_add_comment;
+  r->ctx = p;
+
+  while ((ret = script_next_command(r, &cmd)) != 0) {
+    if (ret < 0) {
+      errors++;
+      continue;
+    }
+
+    if (cmd.block)
+      block_line = cmd.line;
+
+    // the reader only returns '}' to close a block it has seen open
+    if (cmd.name_len == 1 && cmd.name[0] == '}') {
+      if (block && r->block_depth < block_depth) {
+        p->commands[block-1].num_args = p->num_commands - block;
+        block = 0;
+      }
+      continue;
+    }
+
+    spec = NULL;
+    for (i=0; i<sizeof(command_specs)/sizeof(command_specs[0]); i++) {
+      if (strlen(command_specs[i].name) == cmd.name_len &&
+          memcmp(cmd.name, command_specs[i].name, cmd.name_len) == 0) {
+        spec = &command_specs[i];
+        break;
+      }
+    }
+
+    if (!spec) {
+      printf("Unrecognized command at line %d: '%.*s'\n", cmd.line,
+             (int)cmd.name_len, cmd.name);
+      errors++;
+      continue;
+    }
+
+    if (cmd.num_args < spec->min_args || cmd.num_args > spec->max_args) {
+      if (spec->min_args == spec->max_args)
+        printf("At line %d, Command '%s' expect %d arguments, given %d.\n",
+               cmd.line, spec->name, spec->min_args, cmd.num_args);
+      else
+        printf("At line %d, Command '%s' expect %d to %d arguments, given "
+               "%d.\n", cmd.line, spec->name, spec->min_args,
+               spec->max_args, cmd.num_args);
+      errors++;
+      continue;
+    }
+
+    if (cmd.word_args != (spec->word_args &
+                          ((1ull << cmd.num_args) - 1))) {
+      for (i=0; !((cmd.word_args ^ spec->word_args) & (1ull << i)); i++)
+        ;
+      printf("At line %d, argument %d of '%s' should be %s.\n", cmd.line,
+             (int)i + 1, spec->name, (spec->word_args & (1ull << i)) ?
+             "a word" : "a number");
+      errors++;
+      continue;
+    }
+
+    if (validate_command(&cmd, spec->opcode)) {
+      errors++;
+      continue;
+    }
+
+    // press, move and release drive one finger, which has to be down for
+    // the last two and up for the first
+    if (spec->opcode == CMD_PRESS && finger_down) {
+      printf("At line %d, press needs a release before it.\n", cmd.line);
+      errors++;
+      continue;
+    } else if ((spec->opcode == CMD_MOVE || spec->opcode == CMD_RELEASE) &&
+               !finger_down) {
+      printf("At line %d, %s needs a press before it.\n", cmd.line,
+             spec->name);
+      errors++;
+      continue;
+    }
+    if (spec->opcode == CMD_PRESS || spec->opcode == CMD_RELEASE)
+      finger_down = spec->opcode == CMD_PRESS;
+
+    if (spec->opcode == CMD_PARALLEL && !cmd.block) {
+      printf("At line %d, parallel needs a '{' after it.\n", cmd.line);
+      errors++;
+      continue;
+    } else if (spec->opcode == CMD_PARALLEL && block) {
+      printf("At line %d, parallel blocks can't be nested.\n", cmd.line);
+      errors++;
+      continue;
+    } else if (block && !runs_in_parallel(spec->opcode)) {
+      printf("At line %d, '%s' can't run in a parallel block.\n", cmd.line,
+             spec->name);
+      errors++;
+      continue;
+    } else if (block && cmd.line != lane_line) {
+      lane_line = cmd.line;
+      if (++num_lanes > MAX_LANES) {
+        printf("At line %d, a parallel block can have at most %d lines.\n",
+               cmd.line, MAX_LANES);
+        errors++;
+        continue;
+      }
+    }
+
+    command = program_add(p, spec->opcode, cmd.line);
+    // the args array is only allocated once a command has any
+    if (cmd.num_args) {
+      p->args = (int *)grow_array(p->args, &p->args_capacity,
+                                  p->num_args + cmd.num_args, sizeof(int));
+      memcpy(p->args + p->num_args, cmd.args, cmd.num_args * sizeof(int));
+    }
+    command->first_arg = p->num_args;
+    command->num_args = cmd.num_args;
+    p->num_args += cmd.num_args;
+
+    if (spec->opcode == CMD_PARALLEL) {
+      block = p->num_commands;
+      block_depth = r->block_depth;
+      num_lanes = 0;
+      lane_line = 0;
+    }
+  }
+
+  if (r->block_depth) {
+    printf("Missing '}' to end the block at line %d.\n", block_line);
+    errors++;
+    if (block)
+      p->commands[block-1].num_args = p->num_commands - block;
+    r->block_depth = 0;
+  }
+
+  // a stream only runs lines without errors
+  if (!errors)
+    r->finger_down = finger_down;
+  r->on_comment = NULL;
+  return errors;
+}
+
+/* How long a command should take, including the pauses the executors add
+   after drags, pinches and taps. */
+int64_t planned_duration_nsec(int opcode, const int *args, int num_args)
+{
+  switch (opcode) {
+  case CMD_CURVE:
+  case CMD_SPLINE:
+  case CMD_ROTATE:
+  case CMD_SWIPE:
+  case CMD_STRESS:
+    return ((int64_t)args[num_args-1] + 100) * NSEC_PER_MSEC;
+  case CMD_TAP:
+    return (int64_t)args[2] * (args[3] + 150) * NSEC_PER_MSEC;
+  case CMD_DRAG:
+    if (num_args == 8 && args[6] == PROFILE_STOP)
+      return ((int64_t)args[5] + args[7] + 100) * NSEC_PER_MSEC;
+    return ((int64_t)args[5] + 100) * NSEC_PER_MSEC;
+  case CMD_SLEEP:
+    return (int64_t)args[0] * NSEC_PER_MSEC;
+  case CMD_PINCH:
+    return ((int64_t)args[9] + 100) * NSEC_PER_MSEC;
+  case CMD_MOVE:
+    return (int64_t)args[3] * NSEC_PER_MSEC;
+  }
+  return 0;
+}
+
+/* Before a parallel block runs, every lane is planned into a timeline of
+   presses, moves, releases and key events with the same timing the
+   executors use. The timelines are then merged through a min-heap keyed on
+   the time of each lane's next event. Everything due at the same time goes
+   out in one frame, unless a finger would change twice in it, and every
+   finger of every lane gets a slot of its own. */
+enum {
+  LANE_PRESS = 0,
+  LANE_MOVE,
+  LANE_RELEASE,
+  LANE_KEY
+};
+
+/* Changes to keys are tracked as one more finger of the lane */
+#define LANE_KEYS MAX_FINGERS
+
+struct lane_event {
+  int64_t nsec;  /* from the start of the block */
+  int type;
+  int finger;    /* within the lane's gesture, or the key code */
+  int x, y;      /* or the key value in x */
+};
+
+struct lane {
+  struct lane_event *events;
+  size_t num_events;
+  size_t capacity;
+  size_t next;
+  int64_t nsec;              /* where planning has got to */
+  int line;
+  int slots[MAX_FINGERS];    /* -1 while a finger is up */
+  struct point at[MAX_FINGERS];
+  uint32_t changed;          /* fingers changed in the current frame */
+  uint32_t pressed;          /* fingers pressed in the current frame */
+};
+
+void lane_add(struct lane *lane, int64_t nsec, int type, int finger, int x,
+              int y)
+{
+  struct lane_event *event;
+
+  lane->events = (struct lane_event *)grow_array(lane->events,
+                                                 &lane->capacity,
+                                                 lane->num_events + 1,
+                                                 sizeof(*event));
+  event = &lane->events[lane->num_events++];
+  event->nsec = nsec;
+  event->type = type;
+  event->finger = finger;
+  event->x = x;
+  event->y = y;
+}
+
+/* Plan fingers going down together, following their paths, holding still
+   for hold_msec at the end and lifting together, followed by the pause the
+   executors make after a gesture. */
+void plan_touches(struct lane *lane, const struct finger *fingers,
+                  int num_fingers, int num_steps, int duration_msec,
+                  int hold_msec)
+{
+  int64_t start_nsec = lane->nsec, nsec;
+  int i, j;
+
+  for (i=0; i<num_fingers; i++)
+    lane_add(lane, start_nsec, LANE_PRESS, i, fingers[i].x, fingers[i].y);
+  for (j=0; j<num_steps; j++) {
+    nsec = start_nsec +
+      (int64_t)(j+1) * duration_msec * NSEC_PER_MSEC / num_steps;
+    for (i=0; i<num_fingers; i++)
+      lane_add(lane, nsec, LANE_MOVE, i, fingers[i].path[j].x,
+               fingers[i].path[j].y);
+  }
+  nsec = start_nsec + ((int64_t)duration_msec + hold_msec) * NSEC_PER_MSEC;
+  for (i=0; i<num_fingers; i++)
+    lane_add(lane, nsec, LANE_RELEASE, i, 0, 0);
+  lane->nsec = nsec + 100 * NSEC_PER_MSEC;
+}
+
+void plan_command(struct lane *lane, const struct program *p,
+                  const struct command *command)
+{
+  const int *args = command->num_args ? p->args + command->first_arg : NULL;
+  int n = command->num_args;
+  struct finger fingers[MAX_FINGERS];
+  struct point *paths;
+  int num_fingers = 1, num_steps = 1, hold_msec = 0;
+  int i;
+
+  switch (command->opcode) {
+  case CMD_TAP:
+    for (i=0; i<args[2]; i++) {
+      lane_add(lane, lane->nsec, LANE_PRESS, 0, args[0], args[1]);
+      lane_add(lane, lane->nsec + args[3] * NSEC_PER_MSEC, LANE_RELEASE, 0,
+               0, 0);
+      lane->nsec += (args[3] + 150) * NSEC_PER_MSEC;
+    }
+    return;
+  case CMD_SLEEP:
+    lane->nsec += args[0] * NSEC_PER_MSEC;
+    return;
+  case CMD_KEYDOWN:
+  case CMD_KEYUP:
+    lane_add(lane, lane->nsec, LANE_KEY, args[0],
+             command->opcode == CMD_KEYDOWN, 0);
+    return;
+  case CMD_DRAG:
+  case CMD_CURVE:
+  case CMD_SPLINE:
+  case CMD_PINCH:
+    num_fingers = command->opcode == CMD_PINCH ? 2 : 1;
+    num_steps = args[command->opcode == CMD_DRAG ? 4 :
+                     command->opcode == CMD_PINCH ? 8 : n - 2];
+    break;
+  case CMD_ROTATE:
+  case CMD_STRESS:
+    num_fingers = args[n-3];
+    num_steps = args[n-2];
+    break;
+  case CMD_SWIPE:
+    num_fingers = args[4];
+    num_steps = args[6];
+    break;
+  }
+
+  paths = alloc_path(num_fingers * num_steps);
+  fingers[0].x = args[0];
+  fingers[0].y = args[1];
+  fingers[0].path = paths;
+
+  switch (command->opcode) {
+  case CMD_DRAG:
+    profile_path(paths, args[0], args[1], args[2], args[3], num_steps,
+                 args[5], n > 6 ? args[6] : PROFILE_LINEAR,
+                 n > 7 ? args[7] : 0);
+    if (n > 7 && args[6] == PROFILE_STOP)
+      hold_msec = args[7];
+    break;
+  case CMD_CURVE:
+  case CMD_SPLINE:
+    curve_path(paths, command->opcode == CMD_SPLINE, args, (n - 2) / 2,
+               num_steps);
+    break;
+  case CMD_PINCH:
+    pinch_fingers(fingers, paths, args[0], args[1], args[2], args[3],
+                  args[4], args[5], args[6], args[7], num_steps);
+    break;
+  case CMD_ROTATE:
+    rotate_fingers(fingers, paths, args[0], args[1], args[2], args[3],
+                   num_fingers, num_steps);
+    break;
+  case CMD_SWIPE:
+    swipe_fingers(fingers, paths, args[0], args[1], args[2], args[3],
+                  num_fingers, args[5], num_steps);
+    break;
+  case CMD_STRESS:
+    stress_fingers(fingers, paths, args[0], args[1], args[2], num_fingers,
+                   num_steps);
+    break;
+  }
+
+  plan_touches(lane, fingers, num_fingers, num_steps, args[n-1], hold_msec);
+  free(paths);
+}
+
+/* Min-heap of lanes, keyed on the time of their next event. Lanes due at
+   the same time come out in script order. */
+struct lane_heap {
+  struct lane *lanes[MAX_LANES];
+  int size;
+};
+
+int lane_before(const struct lane *a, const struct lane *b)
+{
+  int64_t a_nsec = a->events[a->next].nsec;
+  int64_t b_nsec = b->events[b->next].nsec;
+
+  return a_nsec < b_nsec || (a_nsec == b_nsec && a < b);
+}
+
+void lane_heap_push(struct lane_heap *heap, struct lane *lane)
+{
+  int i = heap->size++, parent;
+
+  while (i > 0 && lane_before(lane, heap->lanes[parent = (i - 1) / 2])) {
+    heap->lanes[i] = heap->lanes[parent];
+    i = parent;
+  }
+  heap->lanes[i] = lane;
+}
+
+struct lane *lane_heap_pop(struct lane_heap *heap)
+{
+  struct lane *top = heap->lanes[0];
+  struct lane *last = heap->lanes[--heap->size];
+  int i = 0, child;
+
+  while ((child = 2 * i + 1) < heap->size) {
+    if (child + 1 < heap->size &&
+        lane_before(heap->lanes[child + 1], heap->lanes[child]))
+      child++;
+    if (!lane_before(heap->lanes[child], last))
+      break;
+    heap->lanes[i] = heap->lanes[child];
+    i = child;
+  }
+  heap->lanes[i] = last;
+  return top;
+}
+
+/* Write what a lane has due at nsec into the current frame, up to the first
+   event for a finger that has already changed in it. Slots of released
+   fingers are added to released, to be freed once the frame is out, and
+   fingers that find no free slot are counted in dropped. */
+void write_lane_events(int fd, uint32_t device_flags, struct lane *lane,
+                       int64_t nsec, uint32_t *released, int *dropped)
+{
+  const struct lane_event *event;
+  int finger, slot;
+  int slots_protocol = (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) &&
+    !(device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC);
+
+  for (; lane->next < lane->num_events; lane->next++) {
+    event = &lane->events[lane->next];
+    finger = event->type == LANE_KEY ? LANE_KEYS : event->finger;
+    if (event->nsec != nsec || (lane->changed & (1u << finger)))
+      break;
+    lane->changed |= 1u << finger;
+
+    if (event->type == LANE_KEY) {
+      write_event(fd, EV_KEY, event->finger, event->x);
+      continue;
+    }
+
+    if (event->type == LANE_PRESS) {
+      lane->slots[finger] = alloc_mt_slot();
+      lane->pressed |= 1u << finger;
+      if (lane->slots[finger] < 0)
+        (*dropped)++;
+    }
+    slot = lane->slots[finger];
+    if (slot < 0)
+      continue;
+    lane->at[finger].x = event->x;
+    lane->at[finger].y = event->y;
+
+    if (event->type == LANE_RELEASE) {
+      *released |= 1u << slot;
+      lane->slots[finger] = -1;
+    }
+    if (!slots_protocol)
+      continue;
+    if (slot != mt_slot)
+      change_mt_slot(fd, device_flags, slot);
+    if (event->type == LANE_RELEASE)
+      write_event(fd, EV_ABS, ABS_MT_TRACKING_ID, -1);
+    else
+      write_finger(fd, device_flags, event->x, event->y,
+                   event->type == LANE_PRESS);
+  }
+}
+
+/* Without slots, every frame has to describe every finger that's down:
+   MT_SYNC devices get a list of them, single-touch devices the first. */
+void write_lane_contacts(int fd, uint32_t device_flags, struct lane *lanes,
+                         int num_lanes, int held)
+{
+  int i, j, num_contacts = 0;
+
+  if (held && (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)) {
+    write_held_contact(fd, device_flags);
+    num_contacts++;
+  }
+
+  for (i=0; i<num_lanes; i++) {
+    for (j=0; j<MAX_FINGERS; j++) {
+      if (lanes[i].slots[j] < 0)
+        continue;
+      if (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC) {
+        write_finger(fd, device_flags, lanes[i].at[j].x, lanes[i].at[j].y,
+                     lanes[i].pressed & (1u << j));
+        write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
+      } else if (!num_contacts) {
+        write_event(fd, EV_ABS, ABS_X, lanes[i].at[j].x);
+        write_event(fd, EV_ABS, ABS_Y, lanes[i].at[j].y);
+      }
+      num_contacts++;
+    }
+  }
+  if (!num_contacts && (device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC))
+    write_event(fd, EV_SYN, SYN_MT_REPORT, 0);
+}
+
+/* Run the commands of a parallel block. Returns how long it was planned to
+   take, which is as long as its longest lane. */
+int64_t execute_parallel(const struct program *p, const struct command *block,
+                         int fd, uint32_t device_flags)
+{
+  const struct command *command, *end = block + 1 + block->num_args;
+  struct lane lanes[MAX_LANES];
+  struct lane_heap heap;
+  struct lane *due[MAX_LANES];
+  int64_t start_nsec, nsec, duration_nsec = 0;
+  int64_t move_pacing_nsec = pacing_nsec(frame_size(device_flags, FRAME_MOVE));
+  uint32_t released, touching;
+  int num_lanes = 0, num_due, touch_changed, dropped = 0;
+  // lanes can't press or release, so a held finger stays down throughout
+  int held = mt_slots_used & 1;
+  int i, j;
+
+  memset(lanes, 0, sizeof(lanes));
+  for (command = block + 1; command < end; command++) {
+    if (command->opcode == CMD_COMMENT) {
+      printf("{}: %.*s\n", (int)command->num_args,
+             p->text + command->first_arg);
+      continue;
+    }
+    if (!num_lanes || lanes[num_lanes-1].line != command->line) {
+      lanes[num_lanes].line = command->line;
+      for (j=0; j<MAX_FINGERS; j++)
+        lanes[num_lanes].slots[j] = -1;
+      num_lanes++;
+    }
+    plan_command(&lanes[num_lanes-1], p, command);
+  }
+
+  heap.size = 0;
+  for (i=0; i<num_lanes; i++) {
+    if (lanes[i].nsec > duration_nsec)
+      duration_nsec = lanes[i].nsec;
+    if (lanes[i].num_events)
+      lane_heap_push(&heap, &lanes[i]);
+  }
+
+  print_action(ACTION_START, TRACE_PARALLEL, num_lanes);
+
+  start_nsec = now_nsec();
+  while (heap.size) {
+    nsec = heap.lanes[0]->events[heap.lanes[0]->next].nsec;
+    execute_sleep_until(start_nsec + nsec - move_pacing_nsec);
+
+    num_due = 0;
+    while (heap.size &&
+           heap.lanes[0]->events[heap.lanes[0]->next].nsec == nsec)
+      due[num_due++] = lane_heap_pop(&heap);
+
+    // one frame, with what every lane has due now
+    touching = mt_slots_used;
+    released = 0;
+    touch_changed = 0;
+    for (i=0; i<num_lanes; i++)
+      lanes[i].changed = lanes[i].pressed = 0;
+    for (i=0; i<num_due; i++) {
+      write_lane_events(fd, device_flags, due[i], nsec, &released, &dropped);
+      touch_changed |= due[i]->changed & ~(1u << LANE_KEYS);
+    }
+    if (touch_changed && !((device_flags & INPUT_DEVICE_CLASS_TOUCH_MT) &&
+                           !(device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC)))
+      write_lane_contacts(fd, device_flags, lanes, num_lanes, held);
+    for (i=0; i<num_due; i++) {
+      if (due[i]->next < due[i]->num_events)
+        lane_heap_push(&heap, due[i]);
+    }
+
+    // the single finger commands leave the slot alone and expect slot 0
+    if (!heap.size && mt_slot > 0)
+      change_mt_slot(fd, device_flags, 0);
+    if (!touching != !(mt_slots_used & ~released))
+      write_event(fd, EV_KEY, BTN_TOUCH, !touching);
+    write_event(fd, EV_SYN, SYN_REPORT, 0);
+    for (i=0; i<MAX_MT_SLOTS; i++) {
+      if (released & (1u << i))
+        free_mt_slot(i);
+    }
+  }
+  execute_sleep_until(start_nsec + duration_nsec);
+
+  print_action(ACTION_END, TRACE_PARALLEL);
+
+  if (dropped)
+    fprintf(stderr, "out of touch slots, %d finger%s of the parallel block "
+            "at line %d never went down\n", dropped, dropped == 1 ? "" : "s",
+            block->line);
+
+  for (i=0; i<num_lanes; i++)
+    free(lanes[i].events);
+  return duration_nsec;
+}
+
+void execute_command(const struct program *p, const struct command *command,
+                     int fd, uint32_t device_flags)
+{
+  const int *args = command->num_args ? p->args + command->first_arg : NULL;
+  int64_t start_nsec = now_nsec();
+  int64_t planned_nsec = 0;
+
+  stats_start_command();
+
+  switch (command->opcode) {
+  case CMD_COMMENT:
+    printf("{}: %.*s\n", (int)command->num_args,
+           p->text + command->first_arg);
+    break;
+  case CMD_TAP:
+    current_gesture = GESTURE_TAP;
+    execute_tap(fd, device_flags, args[0], args[1], args[2], args[3]);
+    break;
+  case CMD_DRAG:
+    current_gesture = GESTURE_DRAG;
+    execute_drag(fd, device_flags, args[0], args[1], args[2],
+                 args[3], args[4], args[5],
+                 command->num_args > 6 ? args[6] : PROFILE_LINEAR,
+                 command->num_args > 7 ? args[7] : 0);
+    break;
+  case CMD_SLEEP:
+    current_gesture = GESTURE_SLEEP;
+    execute_sleep(args[0]);
+    break;
+  case CMD_PINCH:
+    current_gesture = GESTURE_PINCH;
+    execute_pinch(fd, device_flags, args[0], args[1], args[2],
+                  args[3], args[4], args[5], args[6], args[7], args[8],
+                  args[9]);
+    break;
+  case CMD_KEYUP:
+    current_gesture = GESTURE_KEY;
+    execute_keyup(fd, args[0]);
+    break;
+  case CMD_KEYDOWN:
+    current_gesture = GESTURE_KEY;
+    execute_keydown(fd, args[0]);
+    break;
+  case CMD_RESET:
+    current_gesture = GESTURE_RESET;
+    execute_reset(fd, device_flags);
+    break;
+  case CMD_PRESS:
+    current_gesture = GESTURE_TOUCH;
+    // keep multi-touch gestures off the finger that stays down
+    mt_slots_used |= 1;
+    execute_press(fd, device_flags, args[0], args[1]);
+    touch_x = args[0];
+    touch_y = args[1];
+    break;
+  case CMD_MOVE:
+    current_gesture = GESTURE_TOUCH;
+    execute_move_to(fd, device_flags, args[0], args[1], args[2], args[3]);
+    break;
+  case CMD_RELEASE:
+    current_gesture = GESTURE_TOUCH;
+    execute_release(fd, device_flags);
+    free_mt_slot(0);
+    break;
+  case CMD_CURVE:
+  case CMD_SPLINE:
+    current_gesture = GESTURE_CURVE;
+    execute_curve(fd, device_flags, command->opcode == CMD_SPLINE, args,
+                  (command->num_args - 2) / 2, args[command->num_args-2],
+                  args[command->num_args-1]);
+    break;
+  case CMD_ROTATE:
+    current_gesture = GESTURE_ROTATE;
+    execute_rotate(fd, device_flags, args[0], args[1], args[2], args[3],
+                   args[4], args[5], args[6]);
+    break;
+  case CMD_SWIPE:
+    current_gesture = GESTURE_SWIPE;
+    execute_swipe(fd, device_flags, args[0], args[1], args[2], args[3],
+                  args[4], args[5], args[6], args[7]);
+    break;
+  case CMD_STRESS:
+    current_gesture = GESTURE_STRESS;
+    execute_stress(fd, device_flags, args[0], args[1], args[2], args[3],
+                   args[4], args[5]);
+    break;
+  case CMD_PARALLEL:
+    current_gesture = GESTURE_PARALLEL;
+    planned_nsec = execute_parallel(p, command, fd, device_flags);
+    break;
+  }
+
+  if (command->opcode != CMD_PARALLEL)
+    planned_nsec = planned_duration_nsec(command->opcode, args,
+                                         command->num_args);
+  if (command->opcode != CMD_COMMENT)
+    stats_end_command(current_gesture, planned_nsec, start_nsec);
+}
+
+/* Run a program. The commands of a parallel block are run by the block. */
+void execute_program(const struct program *p, int fd, uint32_t device_flags)
+{
+  size_t i;
+
+  for (i=0; i<p->num_commands; i++) {
+    execute_command(p, &p->commands[i], fd, device_flags);
+    if (p->commands[i].opcode == CMD_PARALLEL)
+      i += p->commands[i].num_args;
+  }
+}
+
+/* Check a whole script, and only run it if there is nothing wrong with it. */
+int run_script(struct script_reader *r, int fd, uint32_t device_flags)
+{
+  struct program p;
+  int errors;
+
+  memset(&p, 0, sizeof(p));
+  errors = compile_program(r, &p);
+  if (errors) {
+    printf("%d error%s in script, nothing was sent.\n", errors,
+           errors == 1 ? "" : "s");
+    program_free(&p);
+    return 1;
+  }
+
+  execute_program(&p, fd, device_flags);
+  program_free(&p);
+  return 0;
+}
+
+/* Parse and check a script without running it, to measure how fast that
+   goes. */
+int parse_only(const char *script_file)
+{
+  struct script_reader r;
+  struct program p;
+  int64_t start_nsec, elapsed_nsec;
+  int errors;
+
+  if (script_open(&r, script_file) < 0)
+    return 1;
+
+  memset(&p, 0, sizeof(p));
+  start_nsec = now_nsec();
+  errors = compile_program(&r, &p);
+  elapsed_nsec = now_nsec() - start_nsec;
+
+  fprintf(stderr, "parsed %lu commands, %lu lines, %lu bytes in %.3f ms "
+          "(%.1f MB/s), %d errors\n", (unsigned long)p.num_commands,
+          (unsigned long)r.line, (unsigned long)r.bytes_read,
+          (double)elapsed_nsec / NSEC_PER_MSEC,
+          elapsed_nsec ? (double)r.bytes_read * NSEC_PER_SEC / elapsed_nsec /
+          (1024 * 1024) : 0.0, errors);
+  program_free(&p);
+  script_close(&r);
+
+  return errors ? 1 : 0;
+}
+
+/* Execute script lines as they arrive on in_fd, answering on out_fd with a
+   record of when each command started and finished, or a single error
+   record for a line that has something wrong with it. */
+int write_record(int out_fd, const char *status, int line,
+                 const char *command, int64_t start_nsec, int64_t end_nsec)
+{
+  char record[256];
+  int len, ret;
+
+  len = snprintf(record, sizeof(record), "{ \"status\": \"%s\", "
+                 "\"line\": %d, \"command\": \"%s\", "
+                 "\"start\": %lld.%09lld, \"end\": %lld.%09lld }\n",
+                 status, line, command,
+                 (long long)(start_nsec / NSEC_PER_SEC),
+                 (long long)(start_nsec % NSEC_PER_SEC),
+                 (long long)(end_nsec / NSEC_PER_SEC),
+                 (long long)(end_nsec % NSEC_PER_SEC));
+
+  // the trace writer thread shares stdout, so go through stdio there
+  if (out_fd == STDOUT_FILENO) {
+    flockfile(stdout);
+    fwrite(record, 1, len, stdout);
+    ret = fflush(stdout);
+    funlockfile(stdout);
+    return ret;
+  }
+
+  // anything printed while running the command goes first
+  fflush(stdout);
+  return write_fully(out_fd, record, len);
+}
+
+int serve_stream(int in_fd, int out_fd, int fd, uint32_t device_flags)
+{
+  struct script_reader r;
+  struct program p;
+  const struct command *command;
+  int64_t start_nsec;
+  size_t i;
+  int ret = 0;
+
+  script_init_fd(&r, in_fd);
+  r.single_line = 1;
+
+  while (ret == 0 && script_next_line(&r)) {
+    memset(&p, 0, sizeof(p));
+    if (compile_program(&r, &p)) {
+      start_nsec = now_nsec();
+      ret = write_record(out_fd, "error", r.line, "", start_nsec, start_nsec);
+      program_free(&p);
+      continue;
+    }
+
+    for (i=0; ret == 0 && i<p.num_commands; i++) {
+      command = &p.commands[i];
+      start_nsec = now_nsec();
+      execute_command(&p, command, fd, device_flags);
+      if (command->opcode != CMD_COMMENT)
+        ret = write_record(out_fd, "ok", command->line,
+                           command_name(command->opcode), start_nsec,
+                           now_nsec());
+      if (command->opcode == CMD_PARALLEL)
+        i += command->num_args;
+    }
+    program_free(&p);
+  }
+
+  script_close(&r);
+  return ret;
+}
+
+/* Keep the device open and run scripts sent over a Unix domain socket, one
+   connection at a time. A path starting with '@' names a socket in the
+   abstract namespace, which is what 'adb forward tcp:<port>
+   localabstract:<name>' connects to. */
+/* Anyone who can connect to the socket can drive the device, and abstract
+   sockets can't be protected with file permissions, so only let root, the
+   shell user, whoever started us and the --allow-uid user in. */
+#define AID_SHELL 2000
+
+static int serve_allowed_uid = -1;
+
+int peer_allowed(int conn_fd)
+{
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+    fprintf(stderr, "could not get peer credentials, %s\n", strerror(errno));
+    return 0;
+  }
+  if (cred.uid == 0 || cred.uid == AID_SHELL || cred.uid == getuid() ||
+      (serve_allowed_uid >= 0 && cred.uid == (uid_t)serve_allowed_uid))
+    return 1;
+
+  fprintf(stderr, "refusing connection from uid %d, pid %d\n", (int)cred.uid,
+          (int)cred.pid);
+  return 0;
+}
+
+int serve(int fd, uint32_t device_flags, const char *socket_path)
+{
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  int listen_fd, conn_fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path %s is too long\n", socket_path);
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(socket_path) + 1;
+  if (socket_path[0] == '@') {
+    addr.sun_path[0] = '\0';
+    addr_len--;
+  } else {
+    unlink(socket_path);
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr *)&addr, addr_len) < 0 ||
+      listen(listen_fd, 4) < 0) {
+    fprintf(stderr, "could not listen on %s, %s\n", socket_path,
+            strerror(errno));
+    return 1;
+  }
+  if (socket_path[0] != '@' && chmod(socket_path, 0600) < 0) {
+    fprintf(stderr, "could not chmod %s, %s\n", socket_path, strerror(errno));
+    close(listen_fd);
+    return 1;
+  }
+  // e.g. so a test harness can connect to a server started with sudo
+  if (socket_path[0] != '@' && serve_allowed_uid >= 0 &&
+      chown(socket_path, (uid_t)serve_allowed_uid, (gid_t)-1) < 0) {
+    fprintf(stderr, "could not chown %s, %s\n", socket_path, strerror(errno));
+    close(listen_fd);
+    return 1;
+  }
+
+  // a client going away shouldn't take us with it
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    conn_fd = accept(listen_fd, NULL, NULL);
+    if (conn_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, "accept failed, %s\n", strerror(errno));
+      close(listen_fd);
+      return 1;
+    }
+    if (!peer_allowed(conn_fd)) {
+      close(conn_fd);
+      continue;
+    }
+    serve_stream(conn_fd, conn_fd, fd, device_flags);
+  }
+}
+
+uint32_t parse_device_class(const char *device_class)
+{
+  if (strcmp(device_class, "touch") == 0)
+    return INPUT_DEVICE_CLASS_TOUCH;
+  if (strcmp(device_class, "touch-mt") == 0)
+    return INPUT_DEVICE_CLASS_TOUCH | INPUT_DEVICE_CLASS_TOUCH_MT;
+  if (strcmp(device_class, "touch-mt-sync") == 0)
+    return INPUT_DEVICE_CLASS_TOUCH | INPUT_DEVICE_CLASS_TOUCH_MT |
+      INPUT_DEVICE_CLASS_TOUCH_MT_SYNC;
+  return 0;
+}
+
+/* Run a script against the virtual clock for a device of the given class,
+   logging the frames it emits instead of sending them. */
+int compile_script(const char *script_file, const char *output_file,
+                   uint32_t device_flags)
+{
+  struct frame_log_header header;
+  struct script_reader r;
+  FILE *out;
+  int ret;
+
+  if (script_open(&r, script_file) < 0)
+    return 1;
+
+  out = fopen(output_file, "wb");
+  if (!out) {
+    fprintf(stderr, "could not open %s, %s\n", output_file, strerror(errno));
+    script_close(&r);
+    return 1;
+  }
+
+  // the header is filled in once we know how many frames there are
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(header), 1, out);
+
+  clock_mode = CLOCK_MODE_VIRTUAL;
+  virtual_now_nsec = 0;
+  compile_out = out;
+  sink = &log_sink;
+  ret = run_script(&r, -1, device_flags);
+  sink = &device_sink;
+  compile_out = NULL;
+  script_close(&r);
+
+  memcpy(header.magic, FRAME_LOG_MAGIC, sizeof(header.magic));
+  header.version = FRAME_LOG_VERSION;
+  header.kind = FRAME_LOG_COMPILED;
+  header.device_flags = device_flags;
+  header.num_frames = compile_num_frames;
+  header.duration_nsec = virtual_now_nsec;
+
+  if (fseek(out, 0, SEEK_SET) < 0 ||
+      fwrite(&header, sizeof(header), 1, out) != 1 ||
+      fclose(out) != 0) {
+    fprintf(stderr, "could not write %s, %s\n", output_file, strerror(errno));
+    return 1;
+  }
+
+  if (ret)
+    unlink(output_file);
+  return ret;
+}
+
+/* Splits a stream of events read from a device back into the frames the
+   kernel delivered them in. */
+struct frame_splitter {
+  struct input_event events[MAX_FRAME_EVENTS];
+  int num_events;
+  int discard; /* skipping the rest of a frame after SYN_DROPPED */
+  unsigned long num_dropped;
+  int64_t first_nsec; /* timestamp of the first event */
+  int64_t offset_nsec; /* timestamp of the last event, from the first */
+};
+
+void splitter_init(struct frame_splitter *splitter)
+{
+  memset(splitter, 0, sizeof(*splitter));
+  splitter->first_nsec = -1;
+}
+
+/* Add an event. Returns the number of events in splitter->events if it
+   completes a frame, or 0. */
+int splitter_add(struct frame_splitter *splitter,
+                 const struct input_event *event)
+{
+  int64_t nsec = (int64_t)event->time.tv_sec * NSEC_PER_SEC +
+    (int64_t)event->time.tv_usec * NSEC_PER_USEC;
+  int num_events;
+
+  if (splitter->first_nsec < 0)
+    splitter->first_nsec = nsec;
+  splitter->offset_nsec = nsec - splitter->first_nsec;
+
+  // the kernel dropped events, everything up to the next SYN_REPORT is
+  // incomplete
+  if (event->type == EV_SYN && event->code == SYN_DROPPED) {
+    splitter->num_dropped++;
+    splitter->num_events = 0;
+    splitter->discard = 1;
+    return 0;
+  }
+  if (splitter->discard) {
+    if (event->type == EV_SYN && event->code == SYN_REPORT)
+      splitter->discard = 0;
+    return 0;
+  }
+
+  splitter->events[splitter->num_events++] = *event;
+  if ((event->type == EV_SYN && event->code == SYN_REPORT) ||
+      splitter->num_events == MAX_FRAME_EVENTS) {
+    num_events = splitter->num_events;
+    splitter->num_events = 0;
+    return num_events;
+  }
+  return 0;
+}
+
+/* Record mode logs everything a device reports, split into frames at each
+   SYN_REPORT and timed by the kernel's CLOCK_MONOTONIC timestamps. Events
+   are read many at a time, and the log goes through a large stdio buffer,
+   so a fast digitizer costs a handful of syscalls per frame at most. */
+#define RECORD_READ_EVENTS 256
+#define RECORD_BUFFER_SIZE (1024 * 1024)
+
+static volatile sig_atomic_t record_stop = 0;
+
+/* A signal that lands between checking record_stop and blocking in read()
+   wouldn't interrupt it, so the handler also wakes up the poll() on this
+   pipe. */
+static int record_stop_pipe[2] = { -1, -1 };
+
+void stop_recording(int sig)
+{
+  int saved_errno = errno;
+
+  record_stop = 1;
+  if (write(record_stop_pipe[1], "", 1) < 0) {
+    // the pipe is full, so there's a wakeup in it already
+  }
+  errno = saved_errno;
+}
+
+int record_device(const char *device, const char *output_file)
+{
+  struct frame_log_header header;
+  struct input_event events[RECORD_READ_EVENTS];
+  struct frame_splitter splitter;
+  struct sigaction action;
+  struct pollfd pfds[2];
+  int clock_id = CLOCK_MONOTONIC;
+  uint32_t num_frames = 0;
+  int num_events;
+  uint32_t device_flags;
+  FILE *out;
+  ssize_t ret;
+  int fd, i;
+
+  fd = open(device, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s, %s\n", device, strerror(errno));
+    return 1;
+  }
+
+  if (ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0) {
+    fprintf(stderr, "could not switch %s to CLOCK_MONOTONIC, %s\n", device,
+            strerror(errno));
+    close(fd);
+    return 1;
+  }
+  device_flags = figure_out_events_device_reports(fd);
+
+  out = fopen(output_file, "wb");
+  if (!out) {
+    fprintf(stderr, "could not open %s, %s\n", output_file, strerror(errno));
+    close(fd);
+    return 1;
+  }
+  setvbuf(out, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+
+  // the header is filled in once we know how many frames there are
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(header), 1, out);
+
+  if (pipe(record_stop_pipe) < 0) {
+    fprintf(stderr, "could not create pipe, %s\n", strerror(errno));
+    fclose(out);
+    close(fd);
+    return 1;
+  }
+  fcntl(record_stop_pipe[1], F_SETFL, O_NONBLOCK);
+
+  // stop on ^C, waking up the poll we're blocked in
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_recording;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  fprintf(stderr, "recording %s, press ^C to stop\n", device);
+  splitter_init(&splitter);
+
+  pfds[0].fd = fd;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = record_stop_pipe[0];
+  pfds[1].events = POLLIN;
+
+  while (!record_stop) {
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "could not poll %s, %s\n", device, strerror(errno));
+      break;
+    }
+    if (pfds[1].revents)
+      break;
+
+    ret = read(fd, events, sizeof(events));
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "could not read %s, %s\n", device, strerror(errno));
+      break;
+    }
+
+    for (i=0; i<ret/(ssize_t)sizeof(events[0]); i++) {
+      num_events = splitter_add(&splitter, &events[i]);
+      if (num_events) {
+        log_frame(out, splitter.offset_nsec, splitter.events, num_events);
+        num_frames++;
+      }
+    }
+  }
+  close(fd);
+  // a late signal then writes to -1 rather than to whatever reuses the fd
+  i = record_stop_pipe[1];
+  record_stop_pipe[1] = -1;
+  close(i);
+  close(record_stop_pipe[0]);
+
+  if (splitter.num_events) {
+    log_frame(out, splitter.offset_nsec, splitter.events,
+              splitter.num_events);
+    num_frames++;
+  }
+
+  memcpy(header.magic, FRAME_LOG_MAGIC, sizeof(header.magic));
+  header.version = FRAME_LOG_VERSION;
+  header.kind = FRAME_LOG_RECORDED;
+  header.device_flags = device_flags;
+  header.num_frames = num_frames;
+  header.duration_nsec = splitter.offset_nsec;
+
+  if (fseek(out, 0, SEEK_SET) < 0 ||
+      fwrite(&header, sizeof(header), 1, out) != 1 ||
+      fclose(out) != 0) {
+    fprintf(stderr, "could not write %s, %s\n", output_file, strerror(errno));
+    return 1;
+  }
+
+  fprintf(stderr, "recorded %u frames over %.3f sec\n", num_frames,
+          (double)header.duration_nsec / NSEC_PER_SEC);
+  if (splitter.num_dropped)
+    fprintf(stderr, "warning: the kernel dropped events %lu times, "
+            "the recording has gaps\n", splitter.num_dropped);
+  return 0;
+}
+
+int is_frame_log(const char *path)
+{
+  char magic[sizeof(((struct frame_log_header *)0)->magic)];
+  int is_log = 0;
+  FILE *f = fopen(path, "rb");
+
+  if (f) {
+    is_log = fread(magic, sizeof(magic), 1, f) == 1 &&
+      memcmp(magic, FRAME_LOG_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+  }
+  return is_log;
+}
 
-    // some touchscreen devices expect MT_SYN events to be sent after every
-    // touch
-    if(strcmp(device_name, "atmel-touchscreen") == 0 ||
-       strcmp(device_name, "nvodm_touch") == 0 ||
-       strcmp(device_name, "elan-touchscreen") == 0 ||
-       strcmp(device_name, "ft5x06_ts") == 0) {
-      device_classes |= INPUT_DEVICE_CLASS_TOUCH_MT_SYNC;
-    }
+/* Copy a logged frame into frame_events, returning its number of events. */
+int load_logged_frame(const struct frame_log_frame *frame)
+{
+  const struct frame_log_event *event =
+    (const struct frame_log_event *)(frame + 1);
+  uint32_t i;
 
-  // Is this an old style single-touch driver?
-  } else if ((test_bit(BTN_TOUCH, key_bitmask)
-              && test_bit(ABS_X, abs_bitmask)
-              && test_bit(ABS_Y, abs_bitmask))) {
-    device_classes |= INPUT_DEVICE_CLASS_TOUCH;
+  memset(frame_events, 0, frame->num_events * sizeof(frame_events[0]));
+  for (i=0; i<frame->num_events; i++) {
+    frame_events[i].type = event[i].type;
+    frame_events[i].code = event[i].code;
+    frame_events[i].value = event[i].value;
   }
+  return frame->num_events;
+}
 
-  return device_classes;
+int has_syn_report(int num_events)
+{
+  return num_events > 0 &&
+    frame_events[num_events-1].type == EV_SYN &&
+    frame_events[num_events-1].code == SYN_REPORT;
 }
 
-int parseComment(const char *token, int lineCount)
+/* Check a frame log from end to end, before anything is sent. */
+int check_frame_log(const char *name, const unsigned char *log, size_t size)
 {
-  if (*token == '{') {
-    char *comment = strstr(token, "}");
-    if (comment == NULL)
-      comment = strtok(NULL, "}");
-    else
-      *comment = '\0';
-    if (comment == NULL) {
-      printf("Missing '}' to end a comment block at line %d.\n", lineCount);
+  const struct frame_log_header *header;
+  const struct frame_log_frame *frame;
+  const unsigned char *pos, *end = log + size;
+  uint32_t i;
+
+  if (size < sizeof(*header)) {
+    fprintf(stderr, "%s is truncated\n", name);
+    return -1;
+  }
+
+  header = (const struct frame_log_header *)log;
+  if (header->version != FRAME_LOG_VERSION) {
+    fprintf(stderr, "%s has unsupported version %d\n", name, header->version);
+    return -1;
+  }
+
+  pos = (const unsigned char *)(header + 1);
+  for (i=0; i<header->num_frames; i++) {
+    frame = (const struct frame_log_frame *)pos;
+    if ((size_t)(end - pos) < sizeof(*frame) ||
+        frame->num_events > MAX_FRAME_EVENTS ||
+        (size_t)(end - pos) < sizeof(*frame) +
+          frame->num_events * sizeof(struct frame_log_event)) {
+      fprintf(stderr, "%s is corrupt at frame %u\n", name, i);
       return -1;
     }
-    printf("{}: %s%s%s\n", &token[1], (token[1] && comment[0]) ? " " : "", comment);
-    return 1;
+    pos += sizeof(*frame) + frame->num_events * sizeof(struct frame_log_event);
+  }
+  return 0;
+}
+
+/* Replay a checked frame log. Every frame is due at its offset from one
+   start time, so a frame that is written late doesn't delay the ones after
+   it and a long session can't drift. Each frame is copied out before we
+   sleep for it, so that once a deadline comes we only have to write. */
+int replay_frames(int fd, uint32_t device_flags, const char *name,
+                  const unsigned char *log)
+{
+  const struct frame_log_header *header = (const struct frame_log_header *)log;
+  const struct frame_log_frame *frame;
+  const unsigned char *pos;
+  int64_t start_nsec, planned_nsec;
+  int32_t *late_usec = NULL;
+  int64_t total_late_usec = 0;
+  int32_t max_late_usec = 0;
+  uint32_t num_late = 0;
+  uint32_t i;
+  int num_events;
+
+  if (header->kind == FRAME_LOG_RECORDED &&
+      header->device_flags != device_flags)
+    fprintf(stderr, "warning: %s was recorded on device class 0x%x, "
+            "device is 0x%x\n", name, header->device_flags, device_flags);
+  else if (header->device_flags != device_flags)
+    fprintf(stderr, "warning: %s was compiled for device class 0x%x, "
+            "device is 0x%x\n", name, header->device_flags, device_flags);
+
+  if (report_lateness && header->num_frames) {
+    late_usec = (int32_t *)calloc(header->num_frames, sizeof(int32_t));
+    assert(late_usec);
+  }
+
+  print_action(ACTION_START, TRACE_REPLAY, (int)header->num_frames);
+  current_gesture = GESTURE_REPLAY;
+
+  pos = (const unsigned char *)(header + 1);
+  stats_start_command();
+  start_nsec = now_nsec();
+  for (i=0; i<header->num_frames; i++) {
+    frame = (const struct frame_log_frame *)pos;
+    num_events = load_logged_frame(frame);
+    pos += sizeof(*frame) + frame->num_events * sizeof(struct frame_log_event);
+
+    planned_nsec = start_nsec + frame->offset_nsec;
+    wait_until(planned_nsec);
+    // plan before sending so the write is recorded against the frame
+    if (bench_fd >= 0 && has_syn_report(num_events))
+      bench_plan_frame(planned_nsec);
+    send_frame(fd, frame_events, num_events);
+    num_events_written += num_events;
+    if (late_usec)
+      late_usec[i] = (int32_t)((now_nsec() - planned_nsec) / NSEC_PER_USEC);
+    if (has_syn_report(num_events)) {
+      trace_frame(num_events, planned_nsec);
+      stats_frame(planned_nsec);
+    }
+  }
+  wait_until(start_nsec + header->duration_nsec);
+  stats_end_command(GESTURE_REPLAY, header->duration_nsec, start_nsec);
+
+  print_action(ACTION_END, TRACE_REPLAY);
+
+  if (!late_usec)
+    return 0;
+
+  // only print once we're done, so the report doesn't make frames late
+  printf("%8s %12s %10s\n", "frame", "offset_msec", "late_usec");
+  pos = (const unsigned char *)(header + 1);
+  for (i=0; i<header->num_frames; i++) {
+    frame = (const struct frame_log_frame *)pos;
+    pos += sizeof(*frame) + frame->num_events * sizeof(struct frame_log_event);
+
+    printf("%8u %12.3f %10d\n", i, (double)frame->offset_nsec / NSEC_PER_MSEC,
+           late_usec[i]);
+    total_late_usec += late_usec[i];
+    if (late_usec[i] > max_late_usec)
+      max_late_usec = late_usec[i];
+    if (late_usec[i] * NSEC_PER_USEC > MISSED_DEADLINE_NSEC)
+      num_late++;
   }
+  printf("%u frames, %.1f usec late on average, %d usec at most, "
+         "%u more than %lld usec late\n", header->num_frames,
+         (double)total_late_usec / header->num_frames, max_late_usec,
+         num_late, (long long)(MISSED_DEADLINE_NSEC / NSEC_PER_USEC));
+
+  free(late_usec);
   return 0;
 }
 
-void checkArguments(const char *cmd, int argc, int expect, int lineCount)
+/* Replay a compiled script or a recording. */
+int replay_frame_log(int fd, uint32_t device_flags, const char *path)
+{
+  const unsigned char *map;
+  struct stat st;
+  int log_fd;
+  int ret;
+
+  log_fd = open(path, O_RDONLY);
+  if (log_fd < 0 || fstat(log_fd, &st) < 0) {
+    fprintf(stderr, "could not open %s, %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  if (st.st_size == 0) {
+    fprintf(stderr, "%s is truncated\n", path);
+    close(log_fd);
+    return 1;
+  }
+
+  map = (const unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                    log_fd, 0);
+  close(log_fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "could not map %s, %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  ret = check_frame_log(path, map, st.st_size) < 0 ||
+    replay_frames(fd, device_flags, path, map);
+
+  munmap((void *)map, st.st_size);
+  return ret;
+}
+
+/* Replay a raw dump of struct input_events, such as "cat /dev/input/eventN"
+   writes. It's split into frames in memory before anything is sent, and
+   timed by the event timestamps, whatever clock they came from. */
+int replay_raw_dump(int fd, uint32_t device_flags, const char *path)
+{
+  const struct input_event *events;
+  struct frame_log_header *header;
+  struct frame_splitter splitter;
+  struct frame_log_frame *frame;
+  struct frame_log_event *event;
+  unsigned char *log, *pos;
+  size_t num_input_events, i;
+  struct stat st;
+  int num_events, j;
+  int dump_fd;
+  int ret;
+
+  dump_fd = open(path, O_RDONLY);
+  if (dump_fd < 0 || fstat(dump_fd, &st) < 0) {
+    fprintf(stderr, "could not open %s, %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  // struct input_event is bigger on 64-bit kernels; a dump only replays on
+  // a device of the same kind
+  if (st.st_size == 0 || st.st_size % sizeof(struct input_event)) {
+    fprintf(stderr, "%s is not a dump of %u byte input events\n", path,
+            (unsigned)sizeof(struct input_event));
+    close(dump_fd);
+    return 1;
+  }
+  num_input_events = st.st_size / sizeof(struct input_event);
+
+  events = (const struct input_event *)mmap(NULL, st.st_size, PROT_READ,
+                                            MAP_PRIVATE, dump_fd, 0);
+  close(dump_fd);
+  if (events == MAP_FAILED) {
+    fprintf(stderr, "could not map %s, %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  // at worst every event is a frame of its own
+  log = (unsigned char *)malloc(sizeof(*header) + num_input_events *
+                                (sizeof(*frame) + sizeof(*event)));
+  assert(log);
+  header = (struct frame_log_header *)log;
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, FRAME_LOG_MAGIC, sizeof(header->magic));
+  header->version = FRAME_LOG_VERSION;
+  header->kind = FRAME_LOG_RECORDED;
+  header->device_flags = device_flags;
+
+  splitter_init(&splitter);
+  pos = (unsigned char *)(header + 1);
+  for (i=0; i<=num_input_events; i++) {
+    if (i < num_input_events) {
+      num_events = splitter_add(&splitter, &events[i]);
+    } else {
+      // whatever is left after the last SYN_REPORT
+      num_events = splitter.num_events;
+    }
+    if (!num_events)
+      continue;
+
+    frame = (struct frame_log_frame *)pos;
+    memset(frame, 0, sizeof(*frame));
+    frame->offset_nsec = splitter.offset_nsec;
+    frame->num_events = num_events;
+    event = (struct frame_log_event *)(frame + 1);
+    for (j=0; j<num_events; j++) {
+      event[j].type = splitter.events[j].type;
+      event[j].code = splitter.events[j].code;
+      event[j].value = splitter.events[j].value;
+    }
+    pos = (unsigned char *)(event + num_events);
+    header->num_frames++;
+  }
+  header->duration_nsec = splitter.offset_nsec;
+  munmap((void *)events, st.st_size);
+
+  if (splitter.num_dropped)
+    fprintf(stderr, "warning: %s has %lu gaps where the kernel dropped "
+            "events\n", path, splitter.num_dropped);
+
+  ret = replay_frames(fd, device_flags, path, log);
+  free(log);
+  return ret;
+}
+
+/* Converting a recording into a script. Contacts are followed frame by
+   frame, and everything from the first finger down to the last finger up
+   becomes one gesture: a tap if the finger stayed put, a drag if it moved
+   along a straight line at an even pace, and a press, a series of moves and
+   a release otherwise. Gestures with more fingers become pinches. */
+#define CONVERT_MAX_SLOTS 16
+#define CONVERT_TAP_WAIT_NSEC (150 * NSEC_PER_MSEC)  /* after execute_tap() */
+#define CONVERT_DRAG_WAIT_NSEC (100 * NSEC_PER_MSEC) /* after drags, pinches */
+
+/* The first two fingers down, in one frame of a gesture. A finger that isn't
+   down keeps its last position. */
+struct touch_sample {
+  int64_t nsec;
+  int num_fingers; /* how many are down, including any after the first two */
+  unsigned present; /* bitmask of the first two that are down */
+  int x[2], y[2];
+};
+
+enum {
+  CONVERTED_TOUCH = 0,
+  CONVERTED_KEY
+};
+
+struct converted {
+  int kind;
+  int64_t start_nsec;
+  int64_t end_nsec; /* when the last finger was lifted */
+  size_t first_sample;
+  size_t num_samples;
+  int max_fingers;
+  int slots[2]; /* the contacts the first two fingers are */
+  int key, value;
+};
+
+struct converter {
+  struct touch_sample *samples;
+  size_t num_samples, samples_capacity;
+  struct converted *items;
+  size_t num_items, items_capacity;
+  FILE *out;
+  int64_t script_nsec; /* how far the commands written so far have got */
+  int tolerance;
+  unsigned num_commands;
+  unsigned num_approximated;
+  unsigned num_late;
+};
+
+size_t converter_add(struct converter *c, int kind, int64_t nsec)
+{
+  struct converted *item;
+
+  c->items = (struct converted *)grow_array(c->items, &c->items_capacity,
+                                            c->num_items + 1,
+                                            sizeof(struct converted));
+  item = &c->items[c->num_items];
+  memset(item, 0, sizeof(*item));
+  item->kind = kind;
+  item->start_nsec = item->end_nsec = nsec;
+  item->first_sample = c->num_samples;
+  item->slots[0] = item->slots[1] = -1;
+  return c->num_items++;
+}
+
+void convert_emit(struct converter *c, const char *format, ...)
+{
+  va_list ap;
+
+  va_start(ap, format);
+  vfprintf(c->out, format, ap);
+  va_end(ap);
+  c->num_commands++;
+}
+
+/* How far a finger at sample k is from where it would be at the same time,
+   had it moved from sample a to sample b at a steady pace. */
+double sample_error(const struct touch_sample *samples, int finger,
+                    size_t a, size_t b, size_t k)
+{
+  double u = samples[b].nsec > samples[a].nsec ?
+    (double)(samples[k].nsec - samples[a].nsec) /
+    (samples[b].nsec - samples[a].nsec) : 0;
+  double dx = samples[a].x[finger] - samples[k].x[finger] +
+    u * (samples[b].x[finger] - samples[a].x[finger]);
+  double dy = samples[a].y[finger] - samples[k].y[finger] +
+    u * (samples[b].y[finger] - samples[a].y[finger]);
+
+  return sqrt(dx * dx + dy * dy);
+}
+
+/* Douglas-Peucker, with the error measured at the time of each sample, so
+   that moving between the samples kept puts the finger within tolerance of
+   where it was at every frame. Marks the samples to keep in keep (if given)
+   and returns how many there are. */
+size_t simplify_path(const struct touch_sample *samples, size_t num_samples,
+                     int finger, int tolerance, unsigned char *keep)
+{
+  size_t *stack;
+  size_t depth = 0, num_kept = num_samples > 1 ? 2 : 1;
+  size_t a, b, k, worst;
+  double error, worst_error;
+
+  if (keep) {
+    memset(keep, 0, num_samples);
+    keep[0] = keep[num_samples-1] = 1;
+  }
+  if (num_samples < 3)
+    return num_kept;
+
+  stack = (size_t *)malloc(2 * num_samples * sizeof(size_t));
+  assert(stack);
+  stack[depth++] = 0;
+  stack[depth++] = num_samples - 1;
+
+  while (depth) {
+    b = stack[--depth];
+    a = stack[--depth];
+    worst = a;
+    worst_error = tolerance;
+    for (k=a+1; k<b; k++) {
+      error = sample_error(samples, finger, a, b, k);
+      if (error > worst_error) {
+        worst = k;
+        worst_error = error;
+      }
+    }
+    if (worst != a) {
+      if (keep)
+        keep[worst] = 1;
+      num_kept++;
+      stack[depth++] = a;
+      stack[depth++] = worst;
+      stack[depth++] = worst;
+      stack[depth++] = b;
+    }
+  }
+
+  free(stack);
+  return num_kept;
+}
+
+/* Milliseconds from where the script has got to until nsec. The script is
+   moved on by the rounded value, so rounding errors don't add up. */
+int convert_msec_until(struct converter *c, int64_t nsec)
+{
+  int64_t msec = (nsec - c->script_nsec + NSEC_PER_MSEC / 2) / NSEC_PER_MSEC;
+
+  if (msec < 0)
+    msec = 0;
+  c->script_nsec += msec * NSEC_PER_MSEC;
+  return (int)msec;
+}
+
+void convert_sleep_until(struct converter *c, int64_t nsec)
+{
+  int msec = convert_msec_until(c, nsec);
+
+  if (msec > 0)
+    convert_emit(c, "sleep %d\n", msec);
+}
+
+void convert_pinch(struct converter *c, const struct converted *item)
+{
+  const struct touch_sample *samples = c->samples + item->first_sample;
+  size_t n = item->num_samples;
+  size_t first[2], last[2];
+  int finger;
+
+  // each finger's path is the part of the gesture it was down for
+  for (finger=0; finger<2; finger++) {
+    first[finger] = 0;
+    last[finger] = n - 1;
+    while (first[finger] < last[finger] &&
+           !(samples[first[finger]].present & (1u << finger)))
+      first[finger]++;
+    while (last[finger] > first[finger] &&
+           !(samples[last[finger]].present & (1u << finger)))
+      last[finger]--;
+  }
+
+  // a pinch puts both fingers down and lifts them together, and moves them
+  // in straight lines
+  if (item->max_fingers > 2 || first[0] || first[1] ||
+      last[0] != n - 1 || last[1] != n - 1 ||
+      simplify_path(samples, n, 0, c->tolerance, NULL) > 2 ||
+      simplify_path(samples, n, 1, c->tolerance, NULL) > 2)
+    c->num_approximated++;
+
+  convert_emit(c, "pinch %d %d %d %d %d %d %d %d %d %d\n",
+               samples[first[0]].x[0], samples[first[0]].y[0],
+               samples[last[0]].x[0], samples[last[0]].y[0],
+               samples[first[1]].x[1], samples[first[1]].y[1],
+               samples[last[1]].x[1], samples[last[1]].y[1],
+               n > 1 ? (int)(n - 1) : 1,
+               convert_msec_until(c, item->end_nsec));
+  c->script_nsec += CONVERT_DRAG_WAIT_NSEC;
+}
+
+/* next_nsec is when the next gesture starts. Taps and drags wait a while
+   after they're done, so a gesture followed too closely by the next is
+   spelled out with press, move and release. */
+void convert_touch(struct converter *c, const struct converted *item,
+                   int64_t next_nsec)
 {
-  if (argc == expect)
+  const struct touch_sample *samples = c->samples + item->first_sample;
+  size_t n = item->num_samples;
+  unsigned char *keep;
+  size_t i, prev;
+  int still = 1;
+
+  if (item->max_fingers > 1) {
+    convert_pinch(c, item);
+    return;
+  }
+
+  for (i=1; i<n && still; i++)
+    still = hypot(samples[i].x[0] - samples[0].x[0],
+                  samples[i].y[0] - samples[0].y[0]) <= c->tolerance;
+
+  if (still && next_nsec - item->end_nsec >= CONVERT_TAP_WAIT_NSEC) {
+    convert_emit(c, "tap %d %d 1 %d\n", samples[0].x[0], samples[0].y[0],
+                 convert_msec_until(c, item->end_nsec));
+    c->script_nsec += CONVERT_TAP_WAIT_NSEC;
+    return;
+  }
+
+  keep = (unsigned char *)malloc(n);
+  assert(keep);
+  if (!still && simplify_path(samples, n, 0, c->tolerance, keep) == 2 &&
+      next_nsec - item->end_nsec >= CONVERT_DRAG_WAIT_NSEC) {
+    convert_emit(c, "drag %d %d %d %d %d %d\n", samples[0].x[0],
+                 samples[0].y[0], samples[n-1].x[0], samples[n-1].y[0],
+                 (int)(n - 1), convert_msec_until(c, item->end_nsec));
+    c->script_nsec += CONVERT_DRAG_WAIT_NSEC;
+    free(keep);
     return;
+  }
+
+  convert_emit(c, "press %d %d\n", samples[0].x[0], samples[0].y[0]);
+  if (!still) {
+    for (i=1, prev=0; i<n; i++) {
+      if (!keep[i])
+        continue;
+      convert_emit(c, "move %d %d %d %d\n", samples[i].x[0], samples[i].y[0],
+                   (int)(i - prev), convert_msec_until(c, samples[i].nsec));
+      prev = i;
+    }
+  }
+  convert_sleep_until(c, item->end_nsec);
+  convert_emit(c, "release\n");
+  free(keep);
+}
+
+int is_button(int code)
+{
+  return code >= BTN_MISC && code < KEY_OK;
+}
+
+/* Follow the contacts through a checked frame log, collecting gestures and
+   key presses in c. */
+void collect_gestures(struct converter *c, const unsigned char *log)
+{
+  const struct frame_log_header *header = (const struct frame_log_header *)log;
+  const struct frame_log_frame *frame;
+  const struct frame_log_event *event;
+  const unsigned char *pos = (const unsigned char *)(header + 1);
+  struct {
+    int active;
+    int x, y;
+  } contacts[CONVERT_MAX_SLOTS];
+  // devices that need SYN_MT_REPORT list every contact in every frame,
+  // instead of tracking them in slots
+  int listed = header->device_flags & INPUT_DEVICE_CLASS_TOUCH_MT_SYNC;
+  int mt = header->device_flags & INPUT_DEVICE_CLASS_TOUCH_MT;
+  int slot = 0, num_listed = 0, has_data = 0;
+  long touch = -1;
+  struct touch_sample *sample;
+  struct converted *item;
+  int64_t nsec = 0;
+  uint32_t i, j;
+  int k, target, finger;
+
+  memset(contacts, 0, sizeof(contacts));
+
+  for (i=0; i<header->num_frames; i++) {
+    frame = (const struct frame_log_frame *)pos;
+    event = (const struct frame_log_event *)(frame + 1);
+    pos += sizeof(*frame) + frame->num_events * sizeof(*event);
+    nsec = frame->offset_nsec;
+
+    for (j=0; j<frame->num_events; j++) {
+      target = listed ? num_listed : slot;
+
+      if (event[j].type == EV_ABS) {
+        if (event[j].code == ABS_MT_SLOT && !listed) {
+          if (event[j].value >= 0 && event[j].value < CONVERT_MAX_SLOTS)
+            slot = event[j].value;
+        } else if (event[j].code == ABS_MT_TRACKING_ID) {
+          if (listed)
+            has_data |= event[j].value >= 0;
+          else if (target < CONVERT_MAX_SLOTS)
+            contacts[target].active = event[j].value >= 0;
+        } else if ((event[j].code == ABS_MT_POSITION_X ||
+                    event[j].code == ABS_MT_POSITION_Y) &&
+                   target < CONVERT_MAX_SLOTS) {
+          if (event[j].code == ABS_MT_POSITION_X)
+            contacts[target].x = event[j].value;
+          else
+            contacts[target].y = event[j].value;
+          has_data = 1;
+        } else if (event[j].code == ABS_X && !mt) {
+          contacts[0].x = event[j].value;
+        } else if (event[j].code == ABS_Y && !mt) {
+          contacts[0].y = event[j].value;
+        }
+      } else if (event[j].type == EV_KEY) {
+        if (event[j].code == BTN_TOUCH) {
+          if (!mt)
+            contacts[0].active = event[j].value;
+        } else if (!is_button(event[j].code) && event[j].value <= 1) {
+          k = converter_add(c, CONVERTED_KEY, nsec);
+          c->items[k].key = event[j].code;
+          c->items[k].value = event[j].value;
+        }
+      } else if (event[j].type == EV_SYN && event[j].code == SYN_MT_REPORT) {
+        if (has_data && num_listed < CONVERT_MAX_SLOTS)
+          num_listed++;
+        has_data = 0;
+      } else if (event[j].type == EV_SYN && event[j].code == SYN_REPORT) {
+        if (listed) {
+          for (k=0; k<CONVERT_MAX_SLOTS; k++)
+            contacts[k].active = k < num_listed;
+          num_listed = 0;
+        }
+
+        // the frame is complete, take a sample of it
+        c->samples = (struct touch_sample *)
+          grow_array(c->samples, &c->samples_capacity, c->num_samples + 1,
+                     sizeof(struct touch_sample));
+        sample = &c->samples[c->num_samples];
+        memset(sample, 0, sizeof(*sample));
+        sample->nsec = nsec;
+        for (k=0; k<CONVERT_MAX_SLOTS; k++)
+          sample->num_fingers += contacts[k].active;
+
+        if (sample->num_fingers) {
+          if (touch < 0)
+            touch = converter_add(c, CONVERTED_TOUCH, nsec);
+          item = &c->items[touch];
 
-  printf("At line %d, Command '%s' expect %d arguments, given %d.\n",
-         lineCount, cmd, expect, argc);
-  assert(0 && "Stop reading the assertion, read the previous message ...");
+          // the first two contacts down are the fingers we follow
+          for (k=0; k<CONVERT_MAX_SLOTS && item->slots[1] < 0; k++) {
+            if (contacts[k].active && item->slots[0] != k)
+              item->slots[item->slots[0] < 0 ? 0 : 1] = k;
+          }
+          for (finger=0; finger<2; finger++) {
+            k = item->slots[finger];
+            if (k >= 0 && contacts[k].active) {
+              sample->present |= 1u << finger;
+              sample->x[finger] = contacts[k].x;
+              sample->y[finger] = contacts[k].y;
+            } else if (item->num_samples) {
+              sample->x[finger] = sample[-1].x[finger];
+              sample->y[finger] = sample[-1].y[finger];
+            }
+          }
+
+          c->num_samples++;
+          item->num_samples++;
+          if (sample->num_fingers > item->max_fingers)
+            item->max_fingers = sample->num_fingers;
+        } else if (touch >= 0) {
+          c->items[touch].end_nsec = nsec;
+          touch = -1;
+        }
+      }
+    }
+  }
+
+  // the recording stopped with a finger down
+  if (touch >= 0)
+    c->items[touch].end_nsec = nsec;
+}
+
+/* Convert a recording into a script of the gestures orng knows, moving the
+   finger along polylines within tolerance pixels of the recorded paths. */
+int convert_recording(const char *path, const char *output_file,
+                      int tolerance)
+{
+  const struct frame_log_header *header;
+  const unsigned char *map;
+  struct converter c;
+  struct stat st;
+  size_t i;
+  int log_fd;
+
+  log_fd = open(path, O_RDONLY);
+  if (log_fd < 0 || fstat(log_fd, &st) < 0) {
+    fprintf(stderr, "could not open %s, %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (st.st_size == 0) {
+    fprintf(stderr, "%s is truncated\n", path);
+    close(log_fd);
+    return 1;
+  }
+  map = (const unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                    log_fd, 0);
+  close(log_fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "could not map %s, %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (check_frame_log(path, map, st.st_size) < 0) {
+    munmap((void *)map, st.st_size);
+    return 1;
+  }
+  header = (const struct frame_log_header *)map;
+
+  memset(&c, 0, sizeof(c));
+  c.tolerance = tolerance;
+  c.out = fopen(output_file, "w");
+  if (!c.out) {
+    fprintf(stderr, "could not open %s, %s\n", output_file, strerror(errno));
+    munmap((void *)map, st.st_size);
+    return 1;
+  }
+
+  collect_gestures(&c, map);
+
+  fprintf(c.out, "# converted from %s, tolerance %d px\n", path, tolerance);
+  for (i=0; i<c.num_items; i++) {
+    const struct converted *item = &c.items[i];
+
+    if (c.script_nsec > item->start_nsec + NSEC_PER_MSEC)
+      c.num_late++;
+    convert_sleep_until(&c, item->start_nsec);
+
+    if (item->kind == CONVERTED_KEY)
+      convert_emit(&c, "%s %d\n", item->value ? "keydown" : "keyup",
+                   item->key);
+    else
+      convert_touch(&c, item, i + 1 < c.num_items ?
+                    c.items[i+1].start_nsec : INT64_MAX);
+  }
+  convert_sleep_until(&c, header->duration_nsec);
+
+  fprintf(stderr, "converted %u frames into %u commands\n",
+          header->num_frames, c.num_commands);
+  if (c.num_approximated)
+    fprintf(stderr, "%u gestures with more than one finger were "
+            "approximated with pinches\n", c.num_approximated);
+  if (c.num_late)
+    fprintf(stderr, "%u gestures start late, the ones before them take "
+            "longer in the script\n", c.num_late);
+
+  free(c.samples);
+  free(c.items);
+  munmap((void *)map, st.st_size);
+  if (fclose(c.out) != 0) {
+    fprintf(stderr, "could not write %s, %s\n", output_file, strerror(errno));
+    return 1;
+  }
+  return 0;
 }
 
 int main(int argc, char *argv[])
 {
-  int i;
   int fd;
-  int ret;
   int c;
   int argcount;
+  int ret;
   int print_device_diagnostics = 0;
+  int rt_priority = 0;
+  int rt_cpu = -1;
+  int benchmark = 0;
+  int trace = 0;
+  int max_drift_usec = 0;
   const char *device;
   const char *script_file;
+  const char *compile_file = NULL;
+  const char *output_file = NULL;
+  const char *parse_file = NULL;
+  const char *socket_path = NULL;
+  const char *chrome_trace_file = NULL;
+  const char *record_file = NULL;
+  int raw_dump = 0;
+  const char *convert_file = NULL;
+  const char *uinput_name = NULL;
+  const char *sink_path = NULL;
+  int64_t start_nsec, start_cpu_nsec;
+  char event_device[64];
+  uint32_t device_flags;
+  int tolerance = 4;
+  uint32_t compile_flags = INPUT_DEVICE_CLASS_TOUCH | INPUT_DEVICE_CLASS_TOUCH_MT;
 
-  int num_args = 0;
-  int args[MAX_COMMAND_ARGS];
-  char *line, *cmd, *arg;
+  enum {
+    OPT_COMPILE = 256,
+    OPT_CLASS,
+    OPT_PARSE_ONLY,
+    OPT_SERVE,
+    OPT_CHROME_TRACE,
+    OPT_MAX_DRIFT,
+    OPT_RECORD,
+    OPT_RAW,
+    OPT_CONVERT,
+    OPT_TOLERANCE,
+    OPT_UINPUT,
+    OPT_SINK,
+    OPT_CLOCK,
+    OPT_ALLOW_UID
+  };
+  static const struct option long_options[] = {
+    { "compile", required_argument, NULL, OPT_COMPILE },
+    { "class", required_argument, NULL, OPT_CLASS },
+    { "parse-only", required_argument, NULL, OPT_PARSE_ONLY },
+    { "serve", required_argument, NULL, OPT_SERVE },
+    { "chrome-trace", required_argument, NULL, OPT_CHROME_TRACE },
+    { "max-drift", required_argument, NULL, OPT_MAX_DRIFT },
+    { "record", required_argument, NULL, OPT_RECORD },
+    { "raw", no_argument, NULL, OPT_RAW },
+    { "convert", required_argument, NULL, OPT_CONVERT },
+    { "tolerance", required_argument, NULL, OPT_TOLERANCE },
+    { "uinput", required_argument, NULL, OPT_UINPUT },
+    { "sink", required_argument, NULL, OPT_SINK },
+    { "clock", required_argument, NULL, OPT_CLOCK },
+    { "allow-uid", required_argument, NULL, OPT_ALLOW_UID },
+    { NULL, 0, NULL, 0 }
+  };
 
-  while ((c = getopt (argc, argv, "it")) != -1) {
+  while ((c = getopt_long(argc, argv, "itSlp:g:sR:c:bo:", long_options,
+                          NULL)) != -1) {
     if (c=='t') {
-      print_actions = 1;
+      trace = 1;
+    } else if (c=='S') {
+      print_stats = 1;
+    } else if (c==OPT_MAX_DRIFT) {
+      max_drift_usec = atoi(optarg);
+      if (max_drift_usec <= 0) {
+        fprintf(stderr, "Invalid drift threshold: %s\n", optarg);
+        return 1;
+      }
+      print_stats = 1;
+    } else if (c==OPT_COMPILE) {
+      compile_file = optarg;
+    } else if (c=='o') {
+      output_file = optarg;
+    } else if (c==OPT_UINPUT) {
+      uinput_name = optarg;
+    } else if (c==OPT_SINK) {
+      sink_path = optarg;
+    } else if (c==OPT_CLOCK) {
+      if (strcmp(optarg, "real") == 0) {
+        clock_mode = CLOCK_MODE_REAL;
+      } else if (strcmp(optarg, "none") == 0) {
+        clock_mode = CLOCK_MODE_NONE;
+      } else if (strcmp(optarg, "virtual") == 0) {
+        clock_mode = CLOCK_MODE_VIRTUAL;
+      } else {
+        fprintf(stderr, "Unknown clock: %s\n", optarg);
+        return 1;
+      }
+    } else if (c==OPT_CONVERT) {
+      convert_file = optarg;
+    } else if (c==OPT_TOLERANCE) {
+      tolerance = atoi(optarg);
+      if (tolerance < 0) {
+        fprintf(stderr, "Invalid tolerance: %s\n", optarg);
+        return 1;
+      }
+    } else if (c==OPT_RAW) {
+      raw_dump = 1;
+    } else if (c=='l') {
+      report_lateness = 1;
+    } else if (c==OPT_RECORD) {
+      record_file = optarg;
+    } else if (c==OPT_PARSE_ONLY) {
+      parse_file = optarg;
+    } else if (c==OPT_SERVE) {
+      socket_path = optarg;
+    } else if (c==OPT_ALLOW_UID) {
+      char *end;
+      long uid;
+
+      errno = 0;
+      uid = strtol(optarg, &end, 10);
+      if (errno || end == optarg || *end || uid < 0 || uid > INT_MAX) {
+        fprintf(stderr, "Invalid uid: %s\n", optarg);
+        return 1;
+      }
+      serve_allowed_uid = (int)uid;
+    } else if (c==OPT_CHROME_TRACE) {
+      chrome_trace_file = optarg;
+      trace = 1;
+    } else if (c==OPT_CLASS) {
+      compile_flags = parse_device_class(optarg);
+      if (!compile_flags) {
+        fprintf(stderr, "Unknown device class: %s\n", optarg);
+        return 1;
+      }
+    } else if (c=='b') {
+      benchmark = 1;
+    } else if (c=='R') {
+      rt_priority = atoi(optarg);
+      if (rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+          rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+        fprintf(stderr, "Invalid real-time priority: %s\n", optarg);
+        return 1;
+      }
+    } else if (c=='c') {
+      char *end;
+      long cpu;
+
+      errno = 0;
+      cpu = strtol(optarg, &end, 10);
+      if (errno || end == optarg || *end || cpu < 0 || cpu >= MAX_CPUS) {
+        fprintf(stderr, "Invalid cpu: %s\n", optarg);
+        return 1;
+      }
+      rt_cpu = (int)cpu;
+    } else if (c=='s') {
+      precise_waits = 1;
     } else if (c=='i') {
       print_device_diagnostics = 1;
+    } else if (c=='p') {
+      if (strcmp(optarg, "none") == 0) {
+        pacing_policy = PACING_NONE;
+      } else if (strcmp(optarg, "frame") == 0) {
+        pacing_policy = PACING_FRAME;
+      } else if (strcmp(optarg, "event") == 0) {
+        pacing_policy = PACING_EVENT;
+      } else {
+        fprintf(stderr, "Unknown pacing policy: %s\n", optarg);
+        return 1;
+      }
+    } else if (c=='g') {
+      pacing_gap_usec = atoi(optarg);
+      if (pacing_gap_usec < 0) {
+        fprintf(stderr, "Invalid pacing gap: %s\n", optarg);
+        return 1;
+      }
     } else {
       fprintf(stderr, "Unknown option: -%c\n", c);
     }
   }
 
   argcount = (argc - optind);
-  if ((print_device_diagnostics && argcount != 1) ||
-      (!print_device_diagnostics && argcount != 2)) {
-    fprintf(stderr, "Usage: %s [options] <device> [script file]\n\n"
+  if (parse_file && argcount == 0) {
+    return parse_only(parse_file);
+  } else if (compile_file && argcount == 0 && output_file) {
+    return compile_script(compile_file, output_file, compile_flags);
+  } else if (record_file && argcount == 0 && output_file) {
+    if (enter_realtime(rt_priority, rt_cpu) < 0)
+      return 1;
+    return record_device(record_file, output_file);
+  } else if (convert_file && argcount == 0 && output_file) {
+    return convert_recording(convert_file, output_file, tolerance);
+  } else if (compile_file || parse_file || record_file || convert_file ||
+             (uinput_name && sink_path) ||
+             argcount != !(uinput_name || sink_path) +
+               !(print_device_diagnostics || socket_path)) {
+    fprintf(stderr, "Usage: %s [options] <device> [script file, or - to "
+            "run commands from stdin]\n"
+            "       %s --compile <script file> -o <output> "
+            "[--class <class>]\n"
+            "       %s --record <device> -o <output> [-R <priority>] "
+            "[-c <cpu>]\n"
+            "       %s --convert <recording> -o <output> "
+            "[--tolerance <px>]\n"
+            "       %s --parse-only <script file>\n"
+            "       %s [options] --serve <socket> <device>\n"
+            "       %s [options] --uinput <device name> [script file]\n"
+            "       %s [options] --sink <null or file> [--class <class>] "
+            "<script file>\n\n"
             "Options:\n"
             "  -i                  print device information\n"
-            "  -t                  print event timings\n", argv[0]);
+            "  -t                  print event timings\n"
+            "  --chrome-trace <file>\n"
+            "                      write event timings to file in the Chrome "
+            "trace-event format\n"
+            "  -S                  print timing statistics for each kind of "
+            "command\n"
+            "  --max-drift <usec>  print timing statistics, and fail if a "
+            "command\n"
+            "                      or frame interval drifts further than this "
+            "from its\n"
+            "                      plan\n"
+            "  -p <policy>         pace events: none, frame (default) or event\n"
+            "  -g <usec>           gap inserted by the pacing policy "
+            "(default: 1000)\n"
+            "  -s                  sleep, then spin up to each frame deadline\n"
+            "  -R <priority>       run SCHED_FIFO at priority, with memory "
+            "locked\n"
+            "  -c <cpu>            pin to cpu\n"
+            "  --clock <clock>     real (default), none to never sleep, or "
+            "virtual to\n"
+            "                      move a simulated clock forward instead "
+            "of sleeping,\n"
+            "                      with --sink only\n"
+            "  -b                  read events back and report injection "
+            "latency\n"
+            "  -l                  when replaying a compiled script or "
+            "recording, print\n"
+            "                      how late each frame was\n"
+            "  --raw               the script file is a raw dump of input "
+            "events\n"
+            "  --compile <script>  compile a script into a frame log that "
+            "can be\n"
+            "                      given in place of the script file\n"
+            "  --record <device>   record everything device reports into a "
+            "frame log\n"
+            "  --convert <recording>\n"
+            "                      convert a recording into a script\n"
+            "  --tolerance <px>    how far a converted path may stray from "
+            "the recorded\n"
+            "                      one (default: 4)\n"
+            "  -o <output>         where to write the compiled script, "
+            "recording or\n"
+            "                      converted script\n"
+            "  --class <class>     device class to compile or sink for: "
+            "touch, touch-mt\n"
+            "                      (default) or touch-mt-sync\n"
+            "  --parse-only <script>\n"
+            "                      only parse a script and report how long "
+            "it took\n"
+            "  --serve <socket>    run script lines sent to a Unix domain "
+            "socket,\n"
+            "                      '@name' for the abstract namespace\n"
+            "  --allow-uid <uid>   also let this user connect to the socket, "
+            "and give\n"
+            "                      them the socket file\n"
+            "  --uinput <name>     create a device from kernel/devspec.h "
+            "through uinput\n"
+            "                      and send events to it, instead of opening "
+            "a device\n"
+            "  --sink <sink>       instead of a device, write raw events to a "
+            "file or pipe,\n"
+            "                      or count them with 'null', and report "
+            "the cpu time\n"
+            "                      spent on each\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+            argv[0]);
     return 1;
   }
-  device = argv[optind];
-  script_file = argv[optind + 1];
-
-  fd = open(device, O_RDWR);
-  if(fd < 0) {
-    fprintf(stderr, "could not open %s, %s\n", device, strerror(errno));
+  // reports are printed on the way out, which a server never takes
+  if (print_stats && socket_path) {
+    fprintf(stderr, "-S and --max-drift don't work with --serve\n");
+    return 1;
+  }
+  if (benchmark && socket_path) {
+    fprintf(stderr, "-b doesn't work with --serve\n");
+    return 1;
+  }
+  if (report_lateness && socket_path) {
+    fprintf(stderr, "-l doesn't work with --serve\n");
     return 1;
   }
+  // a real device can't be driven from a clock that doesn't tick
+  if (clock_mode != CLOCK_MODE_REAL && !sink_path) {
+    fprintf(stderr, "--clock none and --clock virtual need --sink\n");
+    return 1;
+  }
+
+  if (uinput_name) {
+    fd = create_uinput_device(uinput_name, &device_flags, event_device,
+                              sizeof(event_device));
+    if (fd < 0)
+      return 1;
+    device = event_device;
+    script_file = argv[optind];
+    if (device[0])
+      fprintf(stderr, "created %s as %s\n", uinput_name, device);
+  } else if (sink_path) {
+    if (strcmp(sink_path, "null") == 0) {
+      sink = &null_sink;
+      fd = -1;
+    } else {
+      sink = &file_sink;
+      fd = open(sink_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        fprintf(stderr, "could not open %s, %s\n", sink_path,
+                strerror(errno));
+        return 1;
+      }
+    }
+    device = "";
+    device_flags = compile_flags;
+    script_file = argv[optind];
+  } else {
+    device = argv[optind];
+    script_file = argv[optind + 1];
 
-  uint32_t device_flags = figure_out_events_device_reports(fd);
+    fd = open(device, O_RDWR);
+    if(fd < 0) {
+      fprintf(stderr, "could not open %s, %s\n", device, strerror(errno));
+      return 1;
+    }
+
+    device_flags = figure_out_events_device_reports(fd);
+  }
 
   if (print_device_diagnostics) {
     if (device_flags & INPUT_DEVICE_CLASS_TOUCH) {
@@ -505,89 +5167,56 @@ int main(int argc, char *argv[])
     return 0;
   }
 
-  FILE *f = fopen(script_file, "r");
-  if (!f) {
-    printf("Unable to read file %s", script_file);
-    return 1;
-  }
-
-  line = malloc(sizeof(char)*MAX_COMMAND_LEN);
-  int lineCount = 0;
-  while (fgets(line, MAX_COMMAND_LEN, f) != NULL) {
-    // Remove end-of-line comments.
-    char *comment = strstr(line, "#");
-    if (comment != NULL)
-      *comment = '\0';
-
-    lineCount += 1;
-    int hasNextCmd = 1;
-    char *tempLine = line;
-  commandLoop:
-    while (hasNextCmd) {
-      num_args = 0;
-      hasNextCmd = 0;
-      int errCode = 0;
-
-      // Parse {-} comments before command names.
-      do {
-        if ((cmd = strtok(tempLine, " \n")) == NULL)
-          goto commandLoop;
-        tempLine = NULL;
-      } while ((errCode = parseComment(cmd, lineCount)) == 1);
-      if (errCode < 0)
-        return 1;
+  if (benchmark && sink_path) {
+    fprintf(stderr, "-b needs a device to read events back from\n");
+    return 1;
+  }
+  if (benchmark && !device[0]) {
+    fprintf(stderr, "could not find the event device of %s\n", uinput_name);
+    return 1;
+  }
+  if (benchmark && open_bench_reader(device) < 0)
+    return 1;
 
-      while ((arg = strtok(NULL, " \n")) != NULL) {
-        // Parse comment {-} within arguments.
-        if ((errCode = parseComment(arg, lineCount)) != 0) {
-          if (errCode < 0)
-            return 1;
-          continue;
-        }
+  // start the trace writer first, so it doesn't run real-time
+  if (trace && start_tracing(chrome_trace_file) < 0)
+    return 1;
 
-        // If we enter a new command, we remember the position for the next iteration.
-        if (*arg == ';') {
-          hasNextCmd = 1;
-          break;
-        }
+  if (enter_realtime(rt_priority, rt_cpu) < 0)
+    return 1;
 
-        assert(num_args < MAX_COMMAND_ARGS);
+  if (precise_waits && clock_mode == CLOCK_MODE_REAL)
+    calibrate_wait();
 
-        args[num_args] = atoi(arg);
-        num_args++;
-      }
+  start_nsec = now_nsec();
+  start_cpu_nsec = cpu_nsec();
 
-      if (strcmp(cmd, "tap") == 0) {
-        checkArguments(cmd, num_args, 4, lineCount);
-        execute_tap(fd, device_flags, args[0], args[1], args[2], args[3]);
-      } else if (strcmp(cmd, "drag") == 0) {
-        checkArguments(cmd, num_args, 6, lineCount);
-        execute_drag(fd, device_flags, args[0], args[1], args[2],
-                     args[3], args[4], args[5]);
-      } else if (strcmp(cmd, "sleep") == 0) {
-        checkArguments(cmd, num_args, 1, lineCount);
-        execute_sleep(args[0]);
-      } else if (strcmp(cmd, "pinch") == 0) {
-        checkArguments(cmd, num_args, 10, lineCount);
-        execute_pinch(fd, device_flags, args[0], args[1], args[2],
-                      args[3], args[4], args[5], args[6], args[7], args[8],
-                      args[9]);
-      } else if (strcmp(cmd, "keyup") == 0) {
-        checkArguments(cmd, num_args, 1, lineCount);
-        execute_keyup(fd, args[0]);
-      } else if (strcmp(cmd, "keydown") == 0) {
-        checkArguments(cmd, num_args, 1, lineCount);
-        execute_keydown(fd, args[0]);
-      } else if (strcmp(cmd, "reset") == 0) {
-        checkArguments(cmd, num_args, 0, lineCount);
-        execute_reset(fd, device_flags);
-      } else {
-        printf("Unrecognized command at line %d: '%s'\n", lineCount, cmd);
-        return 1;
-      }
-    }
+  if (socket_path) {
+    ret = serve(fd, device_flags, socket_path);
+  } else if (strcmp(script_file, "-") == 0) {
+    ret = serve_stream(STDIN_FILENO, STDOUT_FILENO, fd, device_flags) < 0;
+  } else if (raw_dump) {
+    ret = replay_raw_dump(fd, device_flags, script_file);
+  } else if (is_frame_log(script_file)) {
+    ret = replay_frame_log(fd, device_flags, script_file);
+  } else {
+    struct script_reader r;
+    if (script_open(&r, script_file) < 0)
+      return 1;
+    ret = run_script(&r, fd, device_flags);
+    script_close(&r);
   }
-  free(line);
 
-  return 0;
+  if (sink_path)
+    print_sink_report(cpu_nsec() - start_cpu_nsec, now_nsec() - start_nsec);
+
+  if (benchmark)
+    print_bench_report();
+
+  if (print_stats && print_stats_report(max_drift_usec) > 0 && !ret)
+    ret = 1;
+
+  stop_tracing();
+
+  return ret;
 }
@@ -1,20 +1,87 @@
 #!/usr/bin/env python
 
-import mozdevice
+import json
 import optparse
 import os
+import socket
+import subprocess
 import sys
 import tempfile
 
-class DeviceController(object):
+class ScriptRunner(object):
+    '''Runs each script by pushing it to the device and spawning orng'''
 
-    def __init__(self, dimensions, swipe_padding, input_device, orng_path):
-        self.dimensions = dimensions
-        self.swipe_padding = swipe_padding
+    def __init__(self, input_device, orng_path):
+        import mozdevice
         self.dm = mozdevice.DeviceManagerADB()
         self.input_device = input_device
         self.orng_path = orng_path
 
+    def execute_script(self, events):
+        with tempfile.NamedTemporaryFile() as f:
+            f.write("\n".join(events) + "\n")
+            f.flush()
+            remotefilename = os.path.join(self.dm.getDeviceRoot(),
+                                          os.path.basename(f.name))
+            self.dm.pushFile(f.name, remotefilename)
+            self.dm.shellCheckOutput([self.orng_path, self.input_device,
+                                   remotefilename])
+            self.dm.removeFile(remotefilename)
+
+
+class SocketRunner(object):
+    '''Sends scripts to an 'orng --serve' instance, either through a Unix
+    domain socket on this machine or through a TCP port (e.g. one set up
+    with 'adb forward tcp:<port> localabstract:<name>')'''
+
+    def __init__(self, address):
+        if isinstance(address, int):
+            self.sock = socket.create_connection(("localhost", address))
+        else:
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.connect(address)
+        f = self.sock.makefile("rw")
+        self.stdin = self.stdout = f
+
+    def read_record(self):
+        while True:
+            line = self.stdout.readline()
+            if not line:
+                raise Exception("orng went away")
+            # skip comments and error messages printed along the way
+            if line.startswith('{ "status"'):
+                return json.loads(line)
+
+    def execute_script(self, events):
+        for event in events:
+            self.stdin.write(event + "\n")
+        self.stdin.flush()
+        for event in events:
+            record = self.read_record()
+            if record["status"] != "ok":
+                raise Exception("orng failed to run '%s'" % event)
+
+
+class PipeRunner(SocketRunner):
+    '''Keeps one 'orng <device> -' running in an adb shell and feeds it
+    commands through its stdin'''
+
+    def __init__(self, input_device, orng_path):
+        self.proc = subprocess.Popen(["adb", "shell", orng_path,
+                                      input_device, "-"],
+                                     stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE)
+        self.stdin = self.proc.stdin
+        self.stdout = self.proc.stdout
+
+
+class DeviceController(object):
+
+    def __init__(self, dimensions, swipe_padding, runner):
+        self.dimensions = dimensions
+        self.swipe_padding = swipe_padding
+        self.runner = runner
+
     def get_drag_event(self, touchstart_x1, touchstart_y1, touchend_x1,
                        touchend_y1, duration=1000, num_steps=5):
 
@@ -96,15 +163,7 @@ class DeviceController(object):
 
     def execute_script(self, events):
         '''Executes a set of orangutan commands on the device'''
-        with tempfile.NamedTemporaryFile() as f:
-            f.write("\n".join(events) + "\n")
-            f.flush()
-            remotefilename = os.path.join(self.dm.getDeviceRoot(),
-                                          os.path.basename(f.name))
-            self.dm.pushFile(f.name, remotefilename)
-            self.dm.shellCheckOutput([self.orng_path, self.input_device,
-                                   remotefilename])
-            self.dm.removeFile(remotefilename)
+        self.runner.execute_script(events)
 
     def execute_command(self, cmd, args):
         cmdevents = self.get_cmd_events(cmd, args)
@@ -126,12 +185,31 @@ def main(args=sys.argv[1:]):
     parser.add_option("--orng-path", dest="orng_path",
                       help="path to orng executable (default: /data/local/orng)",
                       default="/data/local/orng")
+    parser.add_option("--socket", dest="socket",
+                      help="send commands to 'orng --serve' listening on "
+                      "this Unix domain socket instead of spawning orng "
+                      "for each command")
+    parser.add_option("--pipe", dest="pipe", action="store_true",
+                      help="keep a single orng running in an adb shell and "
+                      "send it commands through its stdin")
+    parser.add_option("--port", dest="port", type="int",
+                      help="send commands to 'orng --serve' through this "
+                      "TCP port on localhost, e.g. one set up with "
+                      "'adb forward'")
 
     options, args = parser.parse_args()
 
+    if options.socket:
+        runner = SocketRunner(options.socket)
+    elif options.port:
+        runner = SocketRunner(options.port)
+    elif options.pipe:
+        runner = PipeRunner(options.input_device, options.orng_path)
+    else:
+        runner = ScriptRunner(options.input_device, options.orng_path)
+
     controller = DeviceController(eval(options.device_dimensions),
-                                  eval(options.swipe_padding),
-                                  options.input_device, options.orng_path)
+                                  eval(options.swipe_padding), runner)
 
     print "READY"
     sys.stdout.flush()
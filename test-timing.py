@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+
+'''Runs scripts through a host build of orng against the virtual clock and
+checks the timestamps of the frames it writes. Run with "make -f Makefile.in
+check".'''
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+EV_SYN = 0
+SYN_REPORT = 0
+EVENT = struct.Struct("llHHi")
+
+# Ten minute gestures, long enough that step deadlines overflow when worked
+# out in int.
+LONG_SCRIPTS = [
+    "drag 0 0 100 0 4000 600000",
+    "rotate 300 300 50 90 2 4000 600000",
+    "parallel {\ndrag 0 0 100 0 4000 600000\n}",
+]
+STEP_MSEC = 600000.0 / 4000
+
+
+def frame_times(orng, script):
+    '''Returns the time of every frame the script writes, in msec.'''
+    script_file = tempfile.NamedTemporaryFile(mode="w", delete=False)
+    sink_file = tempfile.NamedTemporaryFile(delete=False)
+    try:
+        script_file.write(script + "\n")
+        script_file.close()
+        sink_file.close()
+        subprocess.check_call([orng, "--sink", sink_file.name, "--clock",
+                               "virtual", "--class", "touch-mt",
+                               script_file.name], stdout=open(os.devnull, "w"))
+        with open(sink_file.name, "rb") as f:
+            data = f.read()
+    finally:
+        os.unlink(script_file.name)
+        os.unlink(sink_file.name)
+
+    times = []
+    for i in range(0, len(data), EVENT.size):
+        sec, usec, type, code, value = EVENT.unpack_from(data, i)
+        if type == EV_SYN and code == SYN_REPORT:
+            times.append(sec * 1000.0 + usec / 1000.0)
+    return times
+
+
+def check_long_gesture(orng, script):
+    times = frame_times(orng, script)
+    for i in range(1, len(times)):
+        interval = times[i] - times[i-1]
+        if interval < 0 or interval > STEP_MSEC + 1:
+            return "frame %d is %.3f msec after the one before it" % (
+                i, interval)
+    if times[-1] < 600000:
+        return "ran for %.3f msec" % times[-1]
+    return None
+
+
+def main(args=sys.argv[1:]):
+    orng = args[0] if args else "./orng-host"
+    failures = 0
+
+    for script in LONG_SCRIPTS:
+        error = check_long_gesture(orng, script)
+        name = script.replace("\n", " ")
+        if error:
+            print("FAIL %s: %s" % (name, error))
+            failures += 1
+        else:
+            print("ok   %s" % name)
+
+    return 1 if failures else 0
+
+if __name__ == '__main__':
+    sys.exit(main())